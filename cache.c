@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "cache.h"
+#include "funycode.h"
+
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Open addressing with linear probing, kept at most half full. Every
+ * entry is a single allocation holding the key followed by the
+ * NUL-terminated result. Hits only take the read lock; misses are
+ * converted without any lock held. Either way the result ends up in a
+ * per-thread buffer, as entries can be evicted as soon as the lock is
+ * dropped.
+ *
+ * If the cache has a maximum size, entries are evicted in clock order:
+ * the hand sweeps the table, passing over (and clearing) entries that
+ * were used since it last came by.
+ */
+
+struct entry {
+	uint64_t	 hash;
+	size_t		 keylen;
+	size_t		 len;		/* result length, or FUNYCODE_ERR */
+	int		 error;		/* errno if conversion failed */
+	unsigned char	 used;		/* looked up since the hand passed */
+	char		 data[];
+};
+
+struct cache {
+	convfn		 fn;
+	pthread_rwlock_t lock;
+	struct entry	**tab;
+	size_t		 size;
+	size_t		 n;
+	size_t		 bytes;		/* allocated for entries */
+	size_t		 max;		/* maximum of bytes, or 0 */
+	size_t		 hand;
+};
+
+static __thread char *buf;
+static __thread size_t bufcap;
+
+static uint64_t
+hash(const char *key, size_t len)
+{
+	uint64_t h;
+	size_t i;
+
+	/* FNV-1a hash (see http://www.isthe.com/chongo/tech/comp/fnv/) */
+	h = UINT64_C(0xcbf29ce484222325);
+	for (i = 0; i < len; i++)
+		h = (h ^ (unsigned char) key[i]) * UINT64_C(0x100000001b3);
+
+	return h;
+}
+
+struct cache *
+cache_new(convfn fn)
+{
+	struct cache *c;
+
+	if ((c = calloc(1, sizeof(*c))) == NULL)
+		err(1, "calloc");
+
+	c->fn = fn;
+	pthread_rwlock_init(&c->lock, NULL);
+	c->size = 1024;
+	if ((c->tab = calloc(c->size, sizeof(*c->tab))) == NULL)
+		err(1, "calloc");
+
+	return c;
+}
+
+/*
+ * Limit the memory taken up by entries to about max bytes; 0 means no
+ * limit. Must be called before the cache is used.
+ */
+
+void
+cache_setmax(struct cache *c, size_t max)
+{
+	c->max = max;
+}
+
+void
+cache_free(struct cache *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->size; i++)
+		free(c->tab[i]);
+	free(c->tab);
+	pthread_rwlock_destroy(&c->lock);
+	free(c);
+}
+
+static void
+grow(struct cache *c)
+{
+	struct entry **tab;
+	size_t i, j, size;
+
+	size = c->size * 2;
+	if ((tab = calloc(size, sizeof(*tab))) == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < c->size; i++) {
+		if (c->tab[i] == NULL)
+			continue;
+		for (j = c->tab[i]->hash & (size - 1); tab[j] != NULL;
+		    j = (j + 1) & (size - 1))
+			;
+		tab[j] = c->tab[i];
+	}
+
+	free(c->tab);
+	c->tab = tab;
+	c->size = size;
+}
+
+static size_t
+find(struct cache *c, uint64_t h, const char *key, size_t keylen)
+{
+	struct entry *e;
+	size_t i;
+
+	for (i = h & (c->size - 1); (e = c->tab[i]) != NULL;
+	    i = (i + 1) & (c->size - 1))
+		if (e->hash == h && e->keylen == keylen &&
+		    memcmp(e->data, key, keylen) == 0)
+			break;
+
+	return i;
+}
+
+static size_t
+entrysize(const struct entry *e)
+{
+	return sizeof(*e) + e->keylen +
+	    (e->len == FUNYCODE_ERR ? 0 : e->len) + 1;
+}
+
+/*
+ * Remove the entry in slot i, moving up later entries of the same run
+ * that would otherwise no longer be found.
+ */
+
+static void
+evict(struct cache *c, size_t i)
+{
+	size_t j, home, mask = c->size - 1;
+
+	c->bytes -= entrysize(c->tab[i]);
+	c->n--;
+	free(c->tab[i]);
+	c->tab[i] = NULL;
+
+	for (j = (i + 1) & mask; c->tab[j] != NULL; j = (j + 1) & mask) {
+		home = c->tab[j]->hash & mask;
+		if (((j - home) & mask) >= ((j - i) & mask)) {
+			c->tab[i] = c->tab[j];
+			c->tab[j] = NULL;
+			i = j;
+		}
+	}
+}
+
+/*
+ * Make room for size more bytes.
+ */
+
+static void
+reclaim(struct cache *c, size_t size)
+{
+	struct entry *e;
+
+	while (c->n > 0 && c->bytes + size > c->max) {
+		e = c->tab[c->hand];
+		if (e == NULL || e->used) {
+			if (e != NULL)
+				e->used = 0;
+			c->hand = (c->hand + 1) & (c->size - 1);
+		} else
+			evict(c, c->hand);
+	}
+}
+
+/*
+ * Copy a result to the per-thread buffer.
+ */
+
+static void
+keep(const char *res, size_t len)
+{
+	if (len >= bufcap) {
+		bufcap = len + 1;
+		if ((buf = realloc(buf, bufcap)) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(buf, res, len + 1);
+}
+
+/*
+ * Look up the conversion of a key, converting and adding it if it isn't
+ * there yet. Returns NULL with errno set if the conversion failed. The
+ * result stays valid until the thread's next call.
+ */
+
+const char *
+cache_conv(struct cache *c, const char *key, size_t keylen, size_t *len)
+{
+	struct entry *e;
+	uint64_t h;
+	size_t n;
+	int error;
+
+	h = hash(key, keylen);
+	pthread_rwlock_rdlock(&c->lock);
+	if ((e = c->tab[find(c, h, key, keylen)]) != NULL) {
+		if (!__atomic_load_n(&e->used, __ATOMIC_RELAXED))
+			__atomic_store_n(&e->used, 1, __ATOMIC_RELAXED);
+		n = e->len;
+		error = e->error;
+		if (n != FUNYCODE_ERR)
+			keep(e->data + e->keylen, n);
+	}
+	pthread_rwlock_unlock(&c->lock);
+	if (e != NULL)
+		goto done;
+
+	while ((n = c->fn(buf, bufcap, key, keylen)) != FUNYCODE_ERR &&
+	    n >= bufcap) {
+		bufcap = n + 1;
+		if ((buf = realloc(buf, bufcap)) == NULL)
+			err(1, "realloc");
+	}
+	error = n == FUNYCODE_ERR ? errno : 0;
+
+	e = malloc(sizeof(*e) + keylen + (n == FUNYCODE_ERR ? 0 : n) + 1);
+	if (e == NULL)
+		err(1, "malloc");
+	e->hash = h;
+	e->keylen = keylen;
+	e->len = n;
+	e->error = error;
+	e->used = 0;
+	memcpy(e->data, key, keylen);
+	if (n != FUNYCODE_ERR)
+		memcpy(e->data + keylen, buf, n);
+	e->data[keylen + (n == FUNYCODE_ERR ? 0 : n)] = '\0';
+
+	pthread_rwlock_wrlock(&c->lock);
+	if (c->tab[find(c, h, key, keylen)] != NULL) {
+		/* another thread got there first */
+		free(e);
+	} else if (c->max != 0 && entrysize(e) > c->max) {
+		/* too large to keep at all */
+		free(e);
+	} else {
+		if (c->max != 0)
+			reclaim(c, entrysize(e));
+		c->tab[find(c, h, key, keylen)] = e;
+		c->bytes += entrysize(e);
+		if (++c->n * 2 > c->size)
+			grow(c);
+	}
+	pthread_rwlock_unlock(&c->lock);
+
+done:
+	if (n == FUNYCODE_ERR) {
+		errno = error;
+		return NULL;
+	}
+
+	*len = n;
+
+	return buf;
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+/*
+ * Conversion cache used by the tools: maps names to their encoded or
+ * decoded form, or to FUNYCODE_ERR if conversion failed. Results are
+ * returned in a per-thread buffer.
+ */
+
+typedef size_t	(*convfn)(char *, size_t, const char *, size_t);
+
+struct cache;
+
+struct cache	*cache_new(convfn fn);
+void		 cache_setmax(struct cache *c, size_t max);
+void		 cache_free(struct cache *c);
+const char	*cache_conv(struct cache *c, const char *key, size_t keylen,
+		     size_t *len);
+
+#endif /* CACHE_H */
@@ -0,0 +1,436 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <dlfcn.h>
+#include <wchar.h>
+
+#include "funycode.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define nitems(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+/*
+ * Symbol lookup by name. Every handle gets its own table mapping names
+ * (UTF-8 or wide, kept apart) to the address dlsym() found for their
+ * encoded form. Lookups only take read locks, on the list of handles and
+ * on the table; misses are resolved without the table locked and then
+ * added under its write lock. The list stays read locked for the whole
+ * lookup, so fundlclose(), which takes it for writing, can't free a table
+ * that is in use. Failed lookups aren't cached, so dlerror() keeps
+ * working.
+ */
+
+struct sym {
+	uint64_t	 hash;
+	size_t		 keylen;	/* in bytes */
+	int		 wide;
+	void		*addr;
+	char		 key[];
+};
+
+struct handle {
+	void		*handle;
+	pthread_rwlock_t lock;
+	struct sym	**tab;
+	size_t		 size;
+	size_t		 n;
+	struct handle	*next;
+};
+
+static pthread_rwlock_t handles_lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct handle *handles;
+
+static uint64_t
+hash(const void *key, size_t len, int wide)
+{
+	const unsigned char *p = key;
+	uint64_t h;
+	size_t i;
+
+	/* FNV-1a hash (see http://www.isthe.com/chongo/tech/comp/fnv/) */
+	h = UINT64_C(0xcbf29ce484222325) ^ wide;
+	for (i = 0; i < len; i++)
+		h = (h ^ p[i]) * UINT64_C(0x100000001b3);
+
+	return h;
+}
+
+static struct handle *
+findhandle(void *handle)
+{
+	struct handle *h;
+
+	for (h = handles; h != NULL; h = h->next)
+		if (h->handle == handle)
+			break;
+
+	return h;
+}
+
+/*
+ * Get the table for a handle, adding one if there is none yet. Returns
+ * with the list read locked, which the caller releases when done with the
+ * table.
+ */
+
+static struct handle *
+gethandle(void *handle)
+{
+	struct handle *h;
+
+	for (;;) {
+		pthread_rwlock_rdlock(&handles_lock);
+		if ((h = findhandle(handle)) != NULL)
+			return h;
+		pthread_rwlock_unlock(&handles_lock);
+
+		pthread_rwlock_wrlock(&handles_lock);
+		if (findhandle(handle) == NULL) {
+			if ((h = calloc(1, sizeof(*h))) == NULL)
+				goto fail;
+			h->size = 64;
+			if ((h->tab = calloc(h->size, sizeof(*h->tab))) ==
+			    NULL) {
+				free(h);
+				goto fail;
+			}
+			h->handle = handle;
+			pthread_rwlock_init(&h->lock, NULL);
+			h->next = handles;
+			handles = h;
+		}
+		/* look again, as fundlclose() may get in first */
+		pthread_rwlock_unlock(&handles_lock);
+	}
+
+fail:
+	pthread_rwlock_unlock(&handles_lock);
+
+	return NULL;
+}
+
+/*
+ * Find a name in a table; returns the slot it is in, or the empty slot
+ * it belongs in.
+ */
+
+static size_t
+find(struct handle *h, uint64_t hv, const void *key, size_t keylen, int wide)
+{
+	struct sym *s;
+	size_t i;
+
+	for (i = hv & (h->size - 1); (s = h->tab[i]) != NULL;
+	    i = (i + 1) & (h->size - 1))
+		if (s->hash == hv && s->keylen == keylen && s->wide == wide &&
+		    memcmp(s->key, key, keylen) == 0)
+			break;
+
+	return i;
+}
+
+/*
+ * Add a resolved name; called with the write lock held. If it can't be
+ * added the address is still returned, just not remembered.
+ */
+
+static void
+insert(struct handle *h, uint64_t hv, const void *key, size_t keylen,
+    int wide, void *addr)
+{
+	struct sym **tab, *s;
+	size_t i, j, size;
+
+	i = find(h, hv, key, keylen, wide);
+	if (h->tab[i] != NULL)
+		return;
+
+	if ((h->n + 1) * 2 > h->size) {
+		size = h->size * 2;
+		if ((tab = calloc(size, sizeof(*tab))) == NULL)
+			return;
+		for (i = 0; i < h->size; i++) {
+			if (h->tab[i] == NULL)
+				continue;
+			for (j = h->tab[i]->hash & (size - 1); tab[j] != NULL;
+			    j = (j + 1) & (size - 1))
+				;
+			tab[j] = h->tab[i];
+		}
+		free(h->tab);
+		h->tab = tab;
+		h->size = size;
+		i = find(h, hv, key, keylen, wide);
+	}
+
+	if ((s = malloc(sizeof(*s) + keylen)) == NULL)
+		return;
+	s->hash = hv;
+	s->keylen = keylen;
+	s->wide = wide;
+	s->addr = addr;
+	memcpy(s->key, key, keylen);
+	h->tab[i] = s;
+	h->n++;
+}
+
+/*
+ * Convert UTF-8 to wide characters, independent of the current locale.
+ * Returns the number of characters, or FUNYCODE_ERR on invalid input.
+ */
+
+static size_t
+utf8towcs(wchar_t *dst, const char *src, size_t srclen)
+{
+	const unsigned char *p = (const unsigned char *) src;
+	const unsigned char *end = p + srclen;
+	size_t n, i, len;
+	uint32_t c, min;
+
+	for (n = 0; p < end; n++) {
+		if (*p < 0x80) {
+			dst[n] = *p++;
+			continue;
+		} else if (*p >= 0xc2 && *p < 0xe0) {
+			c = *p & 0x1f;
+			len = 1;
+			min = 0x80;
+		} else if (*p >= 0xe0 && *p < 0xf0) {
+			c = *p & 0x0f;
+			len = 2;
+			min = 0x800;
+		} else if (*p >= 0xf0 && *p < 0xf5) {
+			c = *p & 0x07;
+			len = 3;
+			min = 0x10000;
+		} else
+			goto fail;
+
+		if ((size_t) (end - p) <= len)
+			goto fail;
+		for (i = 1; i <= len; i++) {
+			if ((p[i] & 0xc0) != 0x80)
+				goto fail;
+			c = (c << 6) | (p[i] & 0x3f);
+		}
+		if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+			goto fail;
+
+		dst[n] = c;
+		p += len + 1;
+	}
+
+	return n;
+
+fail:
+	errno = EILSEQ;
+
+	return FUNYCODE_ERR;
+}
+
+/*
+ * Encode a name and look it up with dlsym().
+ */
+
+static void *
+resolve(void *handle, const wchar_t *name, size_t namelen)
+{
+	char buf[256], *enc = buf;
+	size_t enclen;
+	void *addr;
+
+	enclen = wfunencode(enc, sizeof(buf), name, namelen);
+	if (enclen == FUNYCODE_ERR)
+		return NULL;
+	if (enclen >= sizeof(buf)) {
+		if ((enc = malloc(enclen + 1)) == NULL)
+			return NULL;
+		wfunencode(enc, enclen + 1, name, namelen);
+	}
+
+	addr = dlsym(handle, enc);
+
+	if (enc != buf)
+		free(enc);
+
+	return addr;
+}
+
+/*
+ * Convert a UTF-8 or wide name and resolve it; no locks are held here.
+ */
+
+static void *
+resolvekey(void *handle, const void *key, size_t keylen, int wide)
+{
+	wchar_t buf[64], *wname = buf;
+	size_t namelen;
+	void *addr = NULL;
+
+	if (wide)
+		return resolve(handle, key, keylen / sizeof(wchar_t));
+
+	if (keylen > nitems(buf) &&
+	    (wname = malloc(keylen * sizeof(wchar_t))) == NULL)
+		return NULL;
+	if ((namelen = utf8towcs(wname, key, keylen)) != FUNYCODE_ERR)
+		addr = resolve(handle, wname, namelen);
+
+	if (wname != buf)
+		free(wname);
+
+	return addr;
+}
+
+static void *
+lookup(void *handle, const void *key, size_t keylen, int wide)
+{
+	struct handle *h;
+	uint64_t hv;
+	size_t i;
+	void *addr;
+
+	if ((h = gethandle(handle)) == NULL)
+		return NULL;
+
+	hv = hash(key, keylen, wide);
+	pthread_rwlock_rdlock(&h->lock);
+	i = find(h, hv, key, keylen, wide);
+	addr = h->tab[i] != NULL ? h->tab[i]->addr : NULL;
+	pthread_rwlock_unlock(&h->lock);
+
+	if (addr == NULL &&
+	    (addr = resolvekey(handle, key, keylen, wide)) != NULL) {
+		pthread_rwlock_wrlock(&h->lock);
+		insert(h, hv, key, keylen, wide, addr);
+		pthread_rwlock_unlock(&h->lock);
+	}
+
+	pthread_rwlock_unlock(&handles_lock);
+
+	return addr;
+}
+
+void *
+fundlsym(void *handle, const char *name)
+{
+	return lookup(handle, name, strlen(name), 0);
+}
+
+void *
+wfundlsym(void *handle, const wchar_t *name)
+{
+	return lookup(handle, name, wcslen(name) * sizeof(wchar_t), 1);
+}
+
+/*
+ * Resolve a list of names, storing their addresses in addrs if it isn't
+ * NULL. The table is searched under a single read lock and all names
+ * found are added under a single write lock, instead of once per name.
+ * Returns the number of names found, or FUNYCODE_ERR if out of memory.
+ */
+
+size_t
+fundlprefetch(void *handle, const char *const *names, size_t n, void **addrs)
+{
+	struct handle *h;
+	struct sym *s;
+	uint64_t *hv = NULL;
+	void **tmp = NULL;
+	size_t i, found, miss;
+
+	if ((hv = malloc(n * sizeof(*hv))) == NULL)
+		goto fail;
+	if (addrs == NULL && (addrs = tmp = malloc(n * sizeof(*tmp))) == NULL)
+		goto fail;
+	if ((h = gethandle(handle)) == NULL)
+		goto fail;
+
+	pthread_rwlock_rdlock(&h->lock);
+	for (i = 0; i < n; i++) {
+		hv[i] = hash(names[i], strlen(names[i]), 0);
+		s = h->tab[find(h, hv[i], names[i], strlen(names[i]), 0)];
+		addrs[i] = s != NULL ? s->addr : NULL;
+	}
+	pthread_rwlock_unlock(&h->lock);
+
+	for (i = found = miss = 0; i < n; i++) {
+		if (addrs[i] == NULL) {
+			miss++;
+			addrs[i] = resolvekey(handle, names[i],
+			    strlen(names[i]), 0);
+		}
+		if (addrs[i] != NULL)
+			found++;
+	}
+
+	/* insert() skips the names that were already there */
+	if (miss > 0) {
+		pthread_rwlock_wrlock(&h->lock);
+		for (i = 0; i < n; i++)
+			if (addrs[i] != NULL)
+				insert(h, hv[i], names[i], strlen(names[i]), 0,
+				    addrs[i]);
+		pthread_rwlock_unlock(&h->lock);
+	}
+	pthread_rwlock_unlock(&handles_lock);
+
+	free(hv);
+	free(tmp);
+
+	return found;
+
+fail:
+	free(hv);
+	free(tmp);
+
+	return FUNYCODE_ERR;
+}
+
+/*
+ * Forget everything cached for a handle and close it. Taking the list for
+ * writing waits for lookups still using the table.
+ */
+
+int
+fundlclose(void *handle)
+{
+	struct handle **hp, *h;
+	size_t i;
+
+	pthread_rwlock_wrlock(&handles_lock);
+	for (hp = &handles; (h = *hp) != NULL; hp = &h->next)
+		if (h->handle == handle)
+			break;
+	if (h != NULL)
+		*hp = h->next;
+	pthread_rwlock_unlock(&handles_lock);
+
+	if (h != NULL) {
+		for (i = 0; i < h->size; i++)
+			free(h->tab[i]);
+		free(h->tab);
+		pthread_rwlock_destroy(&h->lock);
+		free(h);
+	}
+
+	return dlclose(handle);
+}
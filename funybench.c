@@ -0,0 +1,692 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Benchmark harness. The library is included directly so that the
+ * individual encoder and decoder phases can be timed on their own. Output
+ * is one tab-separated line per corpus, direction and phase.
+ */
+
+#include "funycode.c"
+
+#include <err.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+struct item {
+	char		*name;		/* UTF-8 input */
+	size_t		 namelen;
+	wchar_t		*wname;		/* converted input */
+	size_t		 wnamelen;
+	wchar_t		*cbuf;		/* compressed input */
+	size_t		 cbuflen;
+	size_t		 plen;		/* length of the prefix */
+	char		*enc;		/* encoded name */
+	size_t		 enclen;
+	wchar_t		*dbuf;		/* decoded name, before decompression */
+	size_t		 dbuflen;
+	size_t		 dplen;		/* decoded prefix length */
+	size_t		 dsuffix;	/* offset of the suffix in enc */
+	size_t		 denclen;	/* length of enc without trailing _ */
+};
+
+struct corpus {
+	const char	*name;
+	struct item	*items;
+	size_t		 nitems;
+	size_t		 bytes;
+	size_t		 maxlen;	/* longest name, in bytes */
+};
+
+static double mintime = 0.2;
+static volatile size_t sink;
+
+/*
+ * Corpus generation, using a fixed-seed xorshift generator so results are
+ * comparable between runs.
+ */
+
+static uint64_t rng = UINT64_C(0x9e3779b97f4a7c15);
+
+static uint32_t
+rnd(uint32_t n)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+
+	return (uint32_t) (rng >> 32) % n;
+}
+
+static size_t
+utf8(char *buf, uint32_t cp)
+{
+	if (cp < 0x80) {
+		buf[0] = cp;
+		return 1;
+	} else if (cp < 0x800) {
+		buf[0] = 0xc0 | cp >> 6;
+		buf[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	} else if (cp < 0x10000) {
+		buf[0] = 0xe0 | cp >> 12;
+		buf[1] = 0x80 | (cp >> 6 & 0x3f);
+		buf[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+
+	buf[0] = 0xf0 | cp >> 18;
+	buf[1] = 0x80 | (cp >> 12 & 0x3f);
+	buf[2] = 0x80 | (cp >> 6 & 0x3f);
+	buf[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+static const char *const words[] = {
+	"foo", "bar", "baz", "get", "set", "value", "iterator", "begin", "end",
+	"size", "reset", "parse", "node", "tree", "buffer", "stream", "read",
+	"write", "open", "close", "lock", "unlock", "map", "vector", "string",
+};
+
+static size_t
+gen_ascii(char *buf)
+{
+	size_t len = 0;
+	int i, n;
+
+	n = 1 + rnd(4);
+	for (i = 0; i < n; i++) {
+		if (i > 0)
+			len += sprintf(buf + len, "::");
+		len += sprintf(buf + len, "%s_%s",
+		    words[rnd(nitems(words))], words[rnd(nitems(words))]);
+	}
+	len += sprintf(buf + len, "(int, char const*)");
+
+	return len;
+}
+
+static size_t
+gen_latin1(char *buf)
+{
+	static const uint32_t accents[] = {
+		0xe0, 0xe1, 0xe4, 0xe7, 0xe8, 0xe9, 0xeb, 0xf1, 0xf6, 0xf8,
+		0xfc, 0xdf, 0xc5, 0xc9, 0xd6,
+	};
+	size_t len = 0;
+	int i, n;
+
+	n = 8 + rnd(24);
+	for (i = 0; i < n; i++) {
+		if (rnd(3) == 0)
+			len += utf8(buf + len, accents[rnd(nitems(accents))]);
+		else
+			buf[len++] = 'a' + rnd(26);
+	}
+
+	return len;
+}
+
+static size_t
+gen_cjk(char *buf)
+{
+	size_t len = 0;
+	int i, n;
+
+	n = 2 + rnd(10);
+	for (i = 0; i < n; i++)
+		len += utf8(buf + len, 0x4e00 + rnd(0x5200));
+	if (rnd(2))
+		len += sprintf(buf + len, "::%s", words[rnd(nitems(words))]);
+
+	return len;
+}
+
+static size_t
+gen_emoji(char *buf)
+{
+	size_t len = 0;
+	int i, n;
+
+	n = 1 + rnd(6);
+	for (i = 0; i < n; i++) {
+		len += sprintf(buf + len, "%s", words[rnd(nitems(words))]);
+		len += utf8(buf + len, 0x1f300 + rnd(0x350));
+	}
+
+	return len;
+}
+
+static size_t
+gen_template(char *buf)
+{
+	static const char *const types[] = {
+		"char", "int", "long long", "unsigned int", "wchar_t",
+		"std::__1::basic_string<char, std::__1::char_traits<char>, "
+		    "std::__1::allocator<char> >",
+		"std::__1::chrono::duration<long long, "
+		    "std::__1::ratio<1ll, 1000000000ll> >",
+	};
+	static const char *const containers[] = {
+		"vector", "list", "deque", "__tree", "__hash_table",
+	};
+	const char *t, *c;
+
+	t = types[rnd(nitems(types))];
+	c = containers[rnd(nitems(containers))];
+
+	return sprintf(buf,
+	    "std::__1::%s<%s, std::__1::allocator<%s> >::%s(%s const&)",
+	    c, t, t, words[rnd(nitems(words))], t);
+}
+
+/*
+ * Worst case: a long name made up entirely of distinct non-ASCII code
+ * points, which takes one encoder pass and one insertion per character.
+ */
+
+static size_t
+gen_adversarial(char *buf)
+{
+	size_t len = 0;
+	uint32_t base;
+	int i;
+
+	base = 0x4e00 + rnd(0x1000);
+	for (i = 0; i < 4096; i++)
+		len += utf8(buf + len, base + i * 3);
+
+	return len;
+}
+
+static void
+prepare(struct corpus *c)
+{
+	mbstate_t mbs;
+	size_t i, len;
+
+	for (i = 0; i < c->nitems; i++) {
+		struct item *it = &c->items[i];
+		const char *p;
+		char *enc;
+
+		it->wname = malloc((it->namelen + 1) * sizeof(wchar_t));
+		it->cbuf = malloc((it->namelen + 1) * sizeof(wchar_t));
+		if (it->wname == NULL || it->cbuf == NULL)
+			err(1, "malloc");
+
+		memset(&mbs, 0, sizeof(mbs));
+		p = it->name;
+		it->wnamelen = mbsnrtowcs(it->wname, &p, it->namelen,
+		    it->namelen, &mbs);
+		if (it->wnamelen == (size_t) -1)
+			err(1, "%s: mbsnrtowcs", c->name);
+
+		it->cbuflen = compress(it->cbuf, it->wnamelen, it->wname,
+		    it->wnamelen);
+		if (it->cbuflen == FUNYCODE_ERR)
+			err(1, "%s: compress", c->name);
+		it->plen = encode_prefix(NULL, 0, it->cbuf, it->cbuflen);
+
+		len = wfunencode(NULL, 0, it->wname, it->wnamelen);
+		if (len == FUNYCODE_ERR || (enc = malloc(len + 1)) == NULL)
+			err(1, "%s: wfunencode", c->name);
+		wfunencode(enc, len + 1, it->wname, it->wnamelen);
+		it->enc = enc;
+		it->enclen = len;
+
+		it->denclen = len;
+		it->dbuf = malloc(len * 2 * sizeof(wchar_t) + 1);
+		if (it->dbuf == NULL)
+			err(1, "malloc");
+		it->dplen = decode_prefix(it->dbuf, len * 2, enc,
+		    &it->denclen, &it->dsuffix);
+		it->dbuflen = decode_suffix(it->dbuf, len * 2, it->dplen, enc,
+		    it->denclen, it->dsuffix);
+		if (it->dbuflen == FUNYCODE_ERR)
+			err(1, "%s: decode_suffix", c->name);
+
+		c->bytes += it->namelen;
+		if (it->namelen > c->maxlen)
+			c->maxlen = it->namelen;
+	}
+}
+
+static void
+generate(struct corpus *c, const char *name, size_t (*gen)(char *), size_t n)
+{
+	static char buf[65536];
+	size_t i;
+
+	c->name = name;
+	c->nitems = n;
+	c->items = calloc(n, sizeof(*c->items));
+	if (c->items == NULL)
+		err(1, "calloc");
+
+	for (i = 0; i < n; i++) {
+		c->items[i].namelen = gen(buf);
+		c->items[i].name = strndup(buf, c->items[i].namelen);
+		if (c->items[i].name == NULL)
+			err(1, "strndup");
+	}
+
+	prepare(c);
+}
+
+static void
+load(struct corpus *c, const char *path)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t linecap = 0, cap = 0;
+	ssize_t linelen;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "%s", path);
+
+	c->name = path;
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		while (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen == 0)
+			continue;
+
+		if (c->nitems == cap) {
+			cap = cap == 0 ? 64 : cap * 2;
+			c->items = reallocarray(c->items, cap, sizeof(*c->items));
+			if (c->items == NULL)
+				err(1, "reallocarray");
+		}
+
+		memset(&c->items[c->nitems], 0, sizeof(c->items[0]));
+		c->items[c->nitems].name = strndup(line, linelen);
+		c->items[c->nitems].namelen = linelen;
+		c->nitems++;
+	}
+
+	free(line);
+	fclose(fp);
+
+	prepare(c);
+}
+
+/*
+ * Phases. Each runs once over the entire corpus.
+ */
+
+static void
+enc_convert(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	mbstate_t mbs;
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++) {
+		const char *p = c->items[i].name;
+
+		memset(&mbs, 0, sizeof(mbs));
+		sink += mbsnrtowcs(wbuf, &p, c->items[i].namelen,
+		    c->items[i].namelen, &mbs);
+	}
+}
+
+static void
+enc_compress(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++)
+		sink += compress(wbuf, c->items[i].wnamelen,
+		    c->items[i].wname, c->items[i].wnamelen);
+}
+
+static void
+enc_prefix(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++)
+		sink += encode_prefix(buf, c->maxlen * 4, c->items[i].cbuf,
+		    c->items[i].cbuflen);
+}
+
+static void
+enc_suffix(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++)
+		if (c->items[i].plen != c->items[i].cbuflen)
+			sink += encode_suffix(buf, c->maxlen * 4,
+			    c->items[i].plen, c->items[i].cbuf,
+			    c->items[i].cbuflen);
+}
+
+static void
+enc_total(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++)
+		sink += funencode(buf, c->maxlen * 4, c->items[i].name,
+		    c->items[i].namelen);
+}
+
+static void
+dec_prefix(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	size_t i, encpos, enclen;
+
+	for (i = 0; i < c->nitems; i++) {
+		enclen = c->items[i].enclen;
+		sink += decode_prefix(wbuf, c->maxlen * 4, c->items[i].enc,
+		    &enclen, &encpos);
+	}
+}
+
+static void
+dec_insert(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	size_t i;
+
+	/* includes restoring the prefix, as insertion is destructive */
+	for (i = 0; i < c->nitems; i++) {
+		wmemcpy(wbuf, c->items[i].dbuf, c->items[i].dplen);
+		sink += decode_suffix(wbuf, c->maxlen * 4, c->items[i].dplen,
+		    c->items[i].enc, c->items[i].denclen,
+		    c->items[i].dsuffix);
+	}
+}
+
+static void
+dec_decompress(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++)
+		sink += decompress(wbuf, c->maxlen * 4, c->items[i].dbuf,
+		    c->items[i].dbuflen);
+}
+
+static void
+dec_convert(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	mbstate_t mbs;
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++) {
+		const wchar_t *p = c->items[i].wname;
+
+		memset(&mbs, 0, sizeof(mbs));
+		sink += wcsnrtombs(buf, &p, c->items[i].wnamelen,
+		    c->maxlen * 4, &mbs);
+	}
+}
+
+static void
+dec_total(struct corpus *c, wchar_t *wbuf, char *buf)
+{
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++)
+		sink += fundecode(buf, c->maxlen * 4, c->items[i].enc,
+		    c->items[i].enclen);
+}
+
+/*
+ * The end-to-end phases for a single name, to time names one at a time.
+ */
+
+static void
+enc_one(struct corpus *c, size_t i, char *buf)
+{
+	sink += funencode(buf, c->maxlen * 4, c->items[i].name,
+	    c->items[i].namelen);
+}
+
+static void
+dec_one(struct corpus *c, size_t i, char *buf)
+{
+	sink += fundecode(buf, c->maxlen * 4, c->items[i].enc,
+	    c->items[i].enclen);
+}
+
+static const struct phase {
+	const char	*dir;
+	const char	*name;
+	void		(*run)(struct corpus *, wchar_t *, char *);
+	void		(*one)(struct corpus *, size_t, char *);
+} phases[] = {
+	{ "encode",	"convert",	enc_convert },
+	{ "encode",	"compress",	enc_compress },
+	{ "encode",	"prefix",	enc_prefix },
+	{ "encode",	"suffix",	enc_suffix },
+	{ "encode",	"total",	enc_total,	enc_one },
+	{ "decode",	"prefix",	dec_prefix },
+	{ "decode",	"insert",	dec_insert },
+	{ "decode",	"decompress",	dec_decompress },
+	{ "decode",	"convert",	dec_convert },
+	{ "decode",	"total",	dec_total,	dec_one },
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/*
+ * Time each name on its own, keeping its best time over as many passes
+ * as fit in the minimum time, and report the 99th percentile and the
+ * slowest name: what limits are there to bound is the worst case, which
+ * the mean hides in a corpus of mostly short names.
+ */
+
+static void
+latency(struct corpus *c, const struct phase *ph, char *buf, double *p99,
+    double *max)
+{
+	double *t, start, end, pass;
+	size_t i;
+
+	if ((t = calloc(c->nitems, sizeof(*t))) == NULL)
+		err(1, "calloc");
+
+	pass = now();
+	do {
+		for (i = 0; i < c->nitems; i++) {
+			start = now();
+			ph->one(c, i, buf);
+			end = now();
+			if (t[i] == 0 || end - start < t[i])
+				t[i] = end - start;
+		}
+	} while (now() - pass < mintime);
+
+	qsort(t, c->nitems, sizeof(*t), cmpdouble);
+	*p99 = t[(c->nitems - 1) * 99 / 100] * 1e9;
+	*max = t[c->nitems - 1] * 1e9;
+
+	free(t);
+}
+
+/*
+ * Limits only apply to the end-to-end phases; the others call the
+ * internals directly.
+ */
+
+static void
+run(struct corpus *c, size_t maxlen, size_t maxchars)
+{
+	wchar_t *wbuf;
+	char *buf;
+	size_t i, reps;
+
+	wbuf = malloc((c->maxlen * 4 + 1) * sizeof(wchar_t));
+	buf = malloc(c->maxlen * 4 + 1);
+	if (wbuf == NULL || buf == NULL)
+		err(1, "malloc");
+
+	funsetlimit(FUNYCODE_LIMIT_LEN, maxlen);
+	funsetlimit(FUNYCODE_LIMIT_CHARS, maxchars);
+
+	for (i = 0; i < nitems(phases); i++) {
+		double start, elapsed, p99, max;
+
+		phases[i].run(c, wbuf, buf);	/* warm up */
+
+		start = now();
+		reps = 0;
+		do {
+			phases[i].run(c, wbuf, buf);
+			reps++;
+		} while ((elapsed = now() - start) < mintime);
+
+		printf("%s\t%s\t%s\t%zu\t%zu\t%.1f\t%.2f", c->name,
+		    phases[i].dir, phases[i].name, c->nitems, c->bytes,
+		    elapsed * 1e9 / (reps * c->nitems),
+		    c->bytes * reps / elapsed / 1e6);
+		if (phases[i].one != NULL) {
+			latency(c, &phases[i], buf, &p99, &max);
+			printf("\t%.1f\t%.1f\n", p99, max);
+		} else
+			printf("\t-\t-\n");
+		fflush(stdout);
+	}
+
+	funsetlimit(FUNYCODE_LIMIT_LEN, SIZE_MAX);
+	funsetlimit(FUNYCODE_LIMIT_CHARS, SIZE_MAX);
+
+	free(wbuf);
+	free(buf);
+}
+
+/*
+ * Write the names of a corpus, one per line, as a workload for other tools.
+ */
+
+static void
+dump(const struct corpus *c)
+{
+	size_t i;
+
+	for (i = 0; i < c->nitems; i++) {
+		fwrite(c->items[i].name, 1, c->items[i].namelen, stdout);
+		putchar('\n');
+	}
+}
+
+int
+main(int argc, char *const *argv)
+{
+	static const struct {
+		const char	*name;
+		size_t		(*gen)(char *);
+		size_t		 div;		/* fraction of names to use */
+	} gens[] = {
+		{ "ascii",	gen_ascii,	1 },
+		{ "latin1",	gen_latin1,	1 },
+		{ "cjk",	gen_cjk,	1 },
+		{ "emoji",	gen_emoji,	1 },
+		{ "template",	gen_template,	1 },
+		{ "adversarial", gen_adversarial, 1000 },
+	};
+	struct corpus c;
+	const char *only = NULL;
+	size_t i, n = 10000, maxlen = SIZE_MAX, maxchars = SIZE_MAX;
+	char *ep;
+	int ch, wflag = 0;
+
+	if (setlocale(LC_CTYPE, "") == NULL || MB_CUR_MAX == 1)
+		if (setlocale(LC_CTYPE, "C.UTF-8") == NULL)
+			errx(1, "need a UTF-8 locale");
+
+	while ((ch = getopt(argc, argv, "c:l:n:t:w")) != -1) {
+		switch (ch) {
+		case 'c':
+			only = optarg;
+			break;
+
+		case 'l':
+			maxlen = strtoul(optarg, &ep, 10);
+			if (*ep == ',')
+				maxchars = strtoul(ep + 1, NULL, 10);
+			break;
+
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+
+		case 't':
+			mintime = strtod(optarg, NULL);
+			break;
+
+		case 'w':
+			wflag = 1;
+			break;
+
+		case '?':
+		default:
+			fprintf(stderr, "Usage: %s [-c corpus] [-l len[,chars]] "
+			    "[-n names] [-t seconds] [-w] [file ...]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (!wflag)
+		printf("corpus\tdirection\tphase\tnames\tbytes\t"
+		    "ns_per_name\tMB_per_s\tp99_ns\tmax_ns\n");
+
+	for (i = 0; i < nitems(gens); i++) {
+		if (only != NULL && strcmp(only, gens[i].name) != 0)
+			continue;
+
+		memset(&c, 0, sizeof(c));
+		generate(&c, gens[i].name, gens[i].gen,
+		    n / gens[i].div > 0 ? n / gens[i].div : 1);
+		if (wflag)
+			dump(&c);
+		else
+			run(&c, maxlen, maxchars);
+	}
+
+	for (i = 0; i < (size_t) argc; i++) {
+		memset(&c, 0, sizeof(c));
+		load(&c, argv[i]);
+		if (wflag)
+			dump(&c);
+		else
+			run(&c, maxlen, maxchars);
+	}
+
+	return 0;
+}
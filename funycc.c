@@ -0,0 +1,496 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "funycode.h"
+#include "cache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Lexer state, as it stands at the start of a line.
+ */
+
+#define CODE		0
+#define LCOMMENT	1	/* // comment */
+#define BCOMMENT	2	/* block comment */
+#define STRING		3
+#define CHAR		4
+#define RAW		5	/* C++ raw string literal */
+
+struct lexstate {
+	int		 mode;
+	int		 bol;		/* only whitespace so far on this line */
+	int		 hash;		/* directive name comes next */
+	int		 skip;		/* directive without code operands */
+	char		 delim[17];	/* raw string delimiter */
+};
+
+static const struct lexstate initial = { .mode = CODE, .bol = 1 };
+
+static int
+samestate(const struct lexstate *a, const struct lexstate *b)
+{
+	return a->mode == b->mode && a->bol == b->bol && a->hash == b->hash &&
+	    a->skip == b->skip && strcmp(a->delim, b->delim) == 0;
+}
+
+/*
+ * Directives whose operands aren't C code, and are left alone.
+ */
+
+static const char *const skipdirs[] = {
+	"embed", "error", "ident", "import", "include", "include_next", "line",
+	"pragma", "sccs", "warning",
+};
+
+#define IDSTART	1
+#define IDCHAR	2
+#define NUMCHAR	4
+
+static const unsigned char ctab[256] = {
+	['0' ... '9'] = IDCHAR | NUMCHAR,
+	['A' ... 'Z'] = IDSTART | IDCHAR | NUMCHAR,
+	['a' ... 'z'] = IDSTART | IDCHAR | NUMCHAR,
+	['_'] = IDSTART | IDCHAR | NUMCHAR,
+	['$'] = IDSTART | IDCHAR,
+	['.'] = NUMCHAR,
+	['\''] = NUMCHAR,		/* C++14 digit separator */
+	[0x80 ... 0xff] = IDSTART | IDCHAR,
+};
+
+struct buf {
+	char		*p;
+	size_t		 len;
+	size_t		 cap;
+};
+
+static void
+append(struct buf *b, const char *s, size_t len)
+{
+	if (b->len + len > b->cap) {
+		while (b->len + len > b->cap)
+			b->cap = b->cap == 0 ? 65536 : b->cap * 2;
+		if ((b->p = realloc(b->p, b->cap)) == NULL)
+			err(1, "realloc");
+	}
+
+	memcpy(b->p + b->len, s, len);
+	b->len += len;
+}
+
+static int
+isskipdir(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(skipdirs) / sizeof(skipdirs[0]); i++)
+		if (strlen(skipdirs[i]) == len && memcmp(skipdirs[i], s, len) == 0)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Check for a raw string prefix (R, LR, uR, UR or u8R) followed by '"',
+ * and if so, find its delimiter.
+ */
+
+static int
+israw(struct lexstate *st, const char *s, const char *e, const char *end)
+{
+	const char *d;
+	size_t len = e - s;
+
+	if (e >= end || *e != '"' || e[-1] != 'R' ||
+	    !(len == 1 || (len == 2 && strchr("LuU", *s) != NULL) ||
+	    (len == 3 && s[0] == 'u' && s[1] == '8')))
+		return 0;
+
+	for (d = e + 1; d < end && *d != '(' && d - e - 1 < 16; d++)
+		if (strchr(" ()\\\t\v\f\n", *d) != NULL)
+			return 0;
+	if (d >= end || *d != '(')
+		return 0;
+
+	memcpy(st->delim, e + 1, d - e - 1);
+	st->delim[d - e - 1] = '\0';
+
+	return 1;
+}
+
+/*
+ * Copy source to the output, replacing identifiers that contain anything
+ * but ASCII by their encoded form. Comments, string and character
+ * literals, numbers and the operands of #include and friends are copied
+ * as they are. Identifiers in other directives are replaced, so macro
+ * names and their uses keep matching.
+ *
+ * An encoding made up of only the suffix can start with a digit, which
+ * isn't an identifier; such names are left as they are, and reported.
+ */
+
+static int status;
+
+static void
+lex(struct lexstate *st, struct buf *b, struct cache *c, const char *p,
+    const char *end)
+{
+	const char *out = p, *s, *enc;
+	size_t len, enclen;
+	int ascii;
+
+	while (p < end) {
+		if (*p == '\\' && p + 1 < end && p[1] == '\n' && st->mode != RAW) {
+			/* line splice */
+			p += 2;
+			continue;
+		}
+
+		switch (st->mode) {
+		case LCOMMENT:
+			if (*p == '\n')
+				st->mode = CODE;
+			else {
+				p++;
+				continue;
+			}
+			break;
+
+		case BCOMMENT:
+			if (*p == '*' && p + 1 < end && p[1] == '/') {
+				st->mode = CODE;
+				p += 2;
+			} else
+				p++;
+			continue;
+
+		case STRING:
+		case CHAR:
+			if (*p == '\n') {
+				/* unterminated */
+				st->mode = CODE;
+				break;
+			}
+			if (*p == '\\' && p + 1 < end)
+				p++;
+			else if (*p == (st->mode == STRING ? '"' : '\''))
+				st->mode = CODE;
+			p++;
+			continue;
+
+		case RAW:
+			len = strlen(st->delim);
+			if (*p == ')' && (size_t) (end - p) > len + 1 &&
+			    memcmp(p + 1, st->delim, len) == 0 &&
+			    p[len + 1] == '"') {
+				st->mode = CODE;
+				p += len + 2;
+			} else
+				p++;
+			continue;
+		}
+
+		/* code */
+		switch (*p) {
+		case '\n':
+			*st = initial;
+			p++;
+			continue;
+
+		case ' ':
+		case '\t':
+		case '\r':
+		case '\v':
+		case '\f':
+			p++;
+			continue;
+
+		case '#':
+			if (st->bol)
+				st->hash = 1;
+			st->bol = 0;
+			p++;
+			continue;
+
+		case '/':
+			if (p + 1 < end && p[1] == '/') {
+				st->mode = LCOMMENT;
+				p += 2;
+				continue;
+			} else if (p + 1 < end && p[1] == '*') {
+				st->mode = BCOMMENT;
+				p += 2;
+				continue;
+			}
+			break;
+
+		case '"':
+			st->mode = STRING;
+			break;
+
+		case '\'':
+			st->mode = CHAR;
+			break;
+		}
+
+		st->bol = 0;
+		if (*p == '.' && !(p + 1 < end && p[1] >= '0' && p[1] <= '9')) {
+			st->hash = 0;
+			p++;
+			continue;
+		} else if ((*p >= '0' && *p <= '9') || *p == '.') {
+			/* preprocessing number */
+			for (p++; p < end; p++) {
+				if (strchr("eEpP", p[-1]) != NULL &&
+				    (*p == '+' || *p == '-'))
+					continue;
+				if (!(ctab[(unsigned char) *p] & NUMCHAR))
+					break;
+			}
+			st->hash = 0;
+			continue;
+		} else if (!(ctab[(unsigned char) *p] & IDSTART)) {
+			st->hash = 0;
+			p++;
+			continue;
+		}
+
+		s = p;
+		ascii = 1;
+		for (; p < end && (ctab[(unsigned char) *p] & IDCHAR); p++)
+			if (*p & 0x80)
+				ascii = 0;
+
+		if (st->hash && isskipdir(s, p - s))
+			st->skip = 1;
+		st->hash = 0;
+
+		if (ascii) {
+			if (israw(st, s, p, end)) {
+				st->mode = RAW;
+				p += strlen(st->delim) + 2;
+			}
+			continue;
+		}
+		if (st->skip || (enc = cache_conv(c, s, p - s, &enclen)) == NULL)
+			continue;
+		if (enc[0] >= '0' && enc[0] <= '9') {
+			warnx("%.*s: encoded as %.*s, which is not an identifier",
+			    (int) (p - s), s, (int) enclen, enc);
+			__atomic_store_n(&status, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		append(b, out, s - out);
+		append(b, enc, enclen);
+		out = p;
+	}
+
+	append(b, out, p - out);
+}
+
+/*
+ * Large inputs are split into chunks at line boundaries, which are lexed
+ * in parallel on the assumption that each one starts outside of any
+ * comment, literal or directive. That holds nearly always; chunks where it
+ * doesn't are lexed again afterwards, starting from the right state.
+ */
+
+#define CHUNK	(1024 * 1024)
+
+struct chunk {
+	const char	*start;
+	const char	*end;
+	struct lexstate	 in;		/* state assumed at the start */
+	struct lexstate	 out;		/* state at the end */
+	struct buf	 buf;
+};
+
+struct job {
+	struct chunk	*chunks;
+	size_t		 nchunks;
+	size_t		 next;
+};
+
+static void *
+worker(void *arg)
+{
+	struct job *j = arg;
+	struct cache *c;
+	size_t i;
+
+	c = cache_new(funencode);
+	while ((i = __atomic_fetch_add(&j->next, 1, __ATOMIC_RELAXED)) <
+	    j->nchunks) {
+		struct chunk *ch = &j->chunks[i];
+
+		ch->in = ch->out = initial;
+		lex(&ch->out, &ch->buf, c, ch->start, ch->end);
+	}
+	cache_free(c);
+
+	return NULL;
+}
+
+static void
+filter(const char *src, size_t len, int nthreads)
+{
+	struct job j = { 0 };
+	struct cache *c;
+	pthread_t *threads;
+	const char *p, *end, *nl;
+	size_t i;
+	int t, error;
+
+	j.chunks = calloc(len / CHUNK + 1, sizeof(*j.chunks));
+	if (j.chunks == NULL)
+		err(1, "calloc");
+	for (p = src, end = src + len; p < end; j.nchunks++) {
+		j.chunks[j.nchunks].start = p;
+		if ((size_t) (end - p) > CHUNK &&
+		    (nl = memchr(p + CHUNK, '\n', end - p - CHUNK)) != NULL)
+			p = nl + 1;
+		else
+			p = end;
+		j.chunks[j.nchunks].end = p;
+	}
+
+	if ((size_t) nthreads > j.nchunks)
+		nthreads = j.nchunks > 0 ? j.nchunks : 1;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (threads == NULL)
+		err(1, "calloc");
+
+	for (t = 1; t < nthreads; t++)
+		if ((error = pthread_create(&threads[t], NULL, worker, &j)) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	worker(&j);
+	for (t = 1; t < nthreads; t++)
+		pthread_join(threads[t], NULL);
+	free(threads);
+
+	c = cache_new(funencode);
+	for (i = 0; i < j.nchunks; i++) {
+		struct chunk *ch = &j.chunks[i];
+
+		if (i > 0 && !samestate(&ch->in, &ch[-1].out)) {
+			ch->in = ch->out = ch[-1].out;
+			ch->buf.len = 0;
+			lex(&ch->out, &ch->buf, c, ch->start, ch->end);
+		}
+
+		if (fwrite(ch->buf.p, 1, ch->buf.len, stdout) != ch->buf.len)
+			err(1, "stdout");
+		free(ch->buf.p);
+	}
+	cache_free(c);
+
+	free(j.chunks);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: funycc [-j threads] [file]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *const *argv)
+{
+	struct stat st;
+	struct buf in = { 0 };
+	char *src;
+	size_t len;
+	ssize_t n;
+	long ncpu;
+	int ch, fd, nthreads;
+
+	setlocale(LC_CTYPE, "");
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? ncpu : 1;
+
+	while ((ch = getopt(argc, argv, "j:")) != -1) {
+		switch (ch) {
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				usage();
+			break;
+
+		case '?':
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+
+	if (argc == 1) {
+		if ((fd = open(argv[0], O_RDONLY)) < 0)
+			err(1, "%s", argv[0]);
+		if (fstat(fd, &st) < 0)
+			err(1, "%s", argv[0]);
+		len = st.st_size;
+		src = len == 0 ? NULL :
+		    mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (src == MAP_FAILED)
+			err(1, "%s: mmap", argv[0]);
+		close(fd);
+	} else {
+		for (;;) {
+			if (in.len == in.cap) {
+				in.cap = in.cap == 0 ? 65536 : in.cap * 2;
+				if ((in.p = realloc(in.p, in.cap)) == NULL)
+					err(1, "realloc");
+			}
+			n = read(STDIN_FILENO, in.p + in.len, in.cap - in.len);
+			if (n < 0)
+				err(1, "stdin");
+			else if (n == 0)
+				break;
+			in.len += n;
+		}
+		src = in.p;
+		len = in.len;
+	}
+
+	filter(src, len, nthreads);
+
+	if (fflush(stdout) == EOF)
+		err(1, "stdout");
+
+	return status;
+}
@@ -14,6 +14,13 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/* first, so funycode.h declares the _l functions */
+#ifdef __APPLE__
+# include <xlocale.h>
+#else
+# include <locale.h>
+#endif
+
 #include "funycode.h"
 
 #include <assert.h>
@@ -25,13 +32,66 @@
 #include <string.h>
 #include <wchar.h>
 
-#ifdef __APPLE__
-# include <xlocale.h>
+#define nitems(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+/*
+ * Limits on the work done for a single name, for use with untrusted input.
+ * Both encoding and decoding take time proportional to the length of the
+ * name times the number of distinct encoded characters in it; exceeding
+ * either limit fails with E2BIG. They are shared by all threads, so they
+ * are read and written atomically.
+ */
+
+static size_t limits[] = {
+	[FUNYCODE_LIMIT_LEN] = SIZE_MAX,
+	[FUNYCODE_LIMIT_CHARS] = SIZE_MAX,
+};
+
+#define LIMIT(which)	__atomic_load_n(&limits[which], __ATOMIC_RELAXED)
+
+/*
+ * Optional instrumentation, compiled in with -DFUNYCODE_STATS. Counters are
+ * updated using relaxed atomics; phase timings additionally require
+ * -DFUNYCODE_STATS_CYCLES and are in TSC ticks where available and
+ * nanoseconds otherwise.
+ */
+
+#ifdef FUNYCODE_STATS
+static struct funycode_stats stats;
+
+# define STAT(field, n)							    \
+	__atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
 #else
-# include <locale.h>
+# define STAT(field, n)	do { } while (0)
 #endif
 
-#define nitems(arr)	(sizeof(arr) / sizeof((arr)[0]))
+#if defined(FUNYCODE_STATS) && defined(FUNYCODE_STATS_CYCLES)
+# if defined(__x86_64__) || defined(__i386__)
+#  define cycles()	__builtin_ia32_rdtsc()
+# else
+#  include <time.h>
+
+static unsigned long long
+cycles(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+# endif
+
+# define TIMED(phase, expr)						    \
+	({								    \
+		unsigned long long t_ = cycles();			    \
+		__typeof__(expr) r_ = (expr);				    \
+		STAT(cycles[phase], cycles() - t_);			    \
+		r_;							    \
+	})
+#else
+# define TIMED(phase, expr)	(expr)
+#endif
 
 /*
  * Bootstring parameters. These were empirically determined give generally
@@ -77,18 +137,80 @@
 #define MINDIST		1
 #define MAXDIST		((1 << DISTBITS) - 1 + MINDIST)
 
+_Static_assert(FUNYCODE_WSLEN(0) >= MAXDIST * sizeof(wchar_t),
+    "FUNYCODE_WSLEN too small for the match window");
+
+/*
+ * Match finder. Candidate positions are kept in a hash table indexed by the
+ * low HASHBITS bits of the FNV-1a hash of the next MINCOPY - 1 characters.
+ * As multiplication and exclusive-or modulo a power of two only depend on
+ * the low bits of their operands, those bits can be computed using 32-bit
+ * arithmetic and a mask instead of 64-bit multiplies and a modulo, giving
+ * the exact same hash table layout (and thus the exact same matches).
+ *
+ * Entries hold a 16-bit position tagged with a 16-bit generation; bumping
+ * the generation invalidates the entire table, so it only needs clearing
+ * once every 65535 calls. Stale entries read as position 0, just like the
+ * zero-initialised table used to. Positions are reconstructed relative to
+ * the current one, which is exact for names shorter than 64k characters.
+ * Beyond that, an entry 64k or more characters old can alias to a recent
+ * position. As prefix() checks every candidate, the match it then makes is
+ * still valid, but it may differ from the one a full-width table would
+ * have found, so the encoding of such names can differ from earlier
+ * versions (while still decoding correctly).
+ */
+
+#define HASHBITS	9
+#define HASHSIZE	(1 << HASHBITS)
+#define HASHMASK	(HASHSIZE - 1)
+
+#define FNV_BASIS	UINT32_C(0x84222325)
+#define FNV_PRIME	UINT32_C(0x000001b3)
+
+struct matcher {
+	uint32_t	 tab[HASHSIZE];
+	uint16_t	 gen;
+};
+
+static void
+matcher_reset(struct matcher *m)
+{
+	if (++m->gen == 0) {
+		memset(m->tab, 0, sizeof(m->tab));
+		m->gen++;
+	}
+}
+
 static int
 hash(const wchar_t *buf)
 {
-	size_t i;
-	uint64_t h;
+	uint32_t h;
 
 	/* FNV-1a hash (see http://www.isthe.com/chongo/tech/comp/fnv/) */
-	h = UINT64_C(0xcbf29ce484222325);
-	for (i = 0; i < MINCOPY - 1; i++)
-		h = (h ^ buf[i]) * UINT64_C(0x100000001b3);
+	h = FNV_BASIS;
+	h = (h ^ (uint32_t) buf[0]) * FNV_PRIME;
+	h = (h ^ (uint32_t) buf[1]) * FNV_PRIME;
+	h = (h ^ (uint32_t) buf[2]) * FNV_PRIME;
+
+	return h & HASHMASK;
+}
+
+static size_t
+lookup(const struct matcher *m, int h, size_t pos)
+{
+	uint32_t e;
 
-	return (int) h;
+	e = m->tab[h];
+	if ((e >> 16) != m->gen)
+		return 0;
+
+	return pos - (uint16_t) (pos - e);
+}
+
+static void
+insert(struct matcher *m, int h, size_t pos)
+{
+	m->tab[h] = (uint32_t) m->gen << 16 | (uint16_t) pos;
 }
 
 static size_t
@@ -105,25 +227,35 @@ prefix(const wchar_t *src, size_t srclen, size_t a, size_t b)
 	return len;
 }
 
-static size_t
-compress(wchar_t *dst, size_t dstlen, const wchar_t *src, size_t srclen)
+/*
+ * Compress from *srcposp up to stop, which must either be srclen or leave
+ * enough characters after it for no match to be cut short by the end of
+ * the input (see LOOKAHEAD).
+ */
+
+static int
+compress_run(struct matcher *m, wchar_t *dst, size_t dstlen,
+    size_t *srcposp, size_t *dstposp, const wchar_t *src, size_t srclen,
+    size_t stop)
 {
-	size_t srcpos, dstpos, htab[512] = { 0 };
+	size_t srcpos = *srcposp, dstpos = *dstposp;
 
-	srcpos = dstpos = 0;
-	while (srcpos + (MINCOPY - 1) < srclen) {
+	while (srcpos < stop && srcpos + (MINCOPY - 1) < srclen) {
 		int h;
-		size_t len;
+		size_t cand, len, end;
 
 		if ((src[srcpos] & ~(COPYMASK | DISTMASK)) == BACKREF)
 			goto fail;
 
-		h = hash(src + srcpos) % nitems(htab);
-		if (srcpos - htab[h] >= MINDIST &&
-		    srcpos - htab[h] <= MAXDIST &&
-		    (len = prefix(src, srclen, srcpos, htab[h])) >= MINCOPY) {
+		h = hash(src + srcpos);
+		cand = lookup(m, h, srcpos);
+		if (srcpos - cand >= MINDIST &&
+		    srcpos - cand <= MAXDIST &&
+		    (len = prefix(src, srclen, srcpos, cand)) >= MINCOPY) {
 			OUT(dst, dstlen, dstpos, BACKREF + (len - MINCOPY) +
-			    ((srcpos - htab[h] - MINDIST) << COPYBITS));
+			    ((srcpos - cand - MINDIST) << COPYBITS));
+			STAT(matches, 1);
+			STAT(saved, len - 1);
 		} else {
 			OUT(dst, dstlen, dstpos, src[srcpos]);
 			len = 1;
@@ -131,50 +263,81 @@ compress(wchar_t *dst, size_t dstlen, const wchar_t *src, size_t srclen)
 
 		dstpos++;
 
-		while (1) {
-			htab[h] = srcpos++;
-
-			if (--len == 0)
-				break;
+		/*
+		 * Positions inside a match never start a match themselves,
+		 * but are still entered as candidates for later ones.
+		 */
 
-			h = hash(src + srcpos) % nitems(htab);
-		}
+		end = srcpos + len;
+		insert(m, h, srcpos++);
+		for (; srcpos < end && srcpos + (MINCOPY - 1) < srclen; srcpos++)
+			insert(m, hash(src + srcpos), srcpos);
+		srcpos = end;
 	}
 
-	while (srcpos < srclen) {
+	while (srcpos < stop) {
 		if ((src[srcpos] & ~(COPYMASK | DISTMASK)) == BACKREF)
 			goto fail;
 
 		OUT(dst, dstlen, dstpos++, src[srcpos++]);
 	}
 
-	return dstpos;
+	*srcposp = srcpos;
+	*dstposp = dstpos;
+
+	return 0;
 
 fail:
 	errno = EILSEQ;
 
-	return FUNYCODE_ERR;
+	return -1;
+}
+
+static size_t
+compress(wchar_t *dst, size_t dstlen, const wchar_t *src, size_t srclen)
+{
+	static __thread struct matcher m;
+	size_t srcpos, dstpos;
+
+	srcpos = dstpos = 0;
+	if (srclen >= MINCOPY)
+		matcher_reset(&m);
+
+	if (compress_run(&m, dst, dstlen, &srcpos, &dstpos, src, srclen,
+	    srclen) < 0)
+		return FUNYCODE_ERR;
+
+	return dstpos;
 }
 
 static size_t
 decompress(wchar_t *dst, size_t dstlen, const wchar_t *src, size_t srclen)
 {
+	wchar_t ring[MAXDIST];		/* dst may be too short to copy from */
 	size_t srcpos, dstpos;
 
 	srcpos = dstpos = 0;
 	while (srcpos < srclen) {
 		wchar_t ch;
+		size_t dist, len;
 
 		ch = src[srcpos++];
 		if ((ch & ~(COPYMASK | DISTMASK)) == BACKREF) {
-			size_t pos, len;
-
-			pos = dstpos - (((ch & DISTMASK) >> COPYBITS) + MINDIST);
+			dist = ((ch & DISTMASK) >> COPYBITS) + MINDIST;
 			len = (ch & COPYMASK) + MINCOPY;
-
-			while (len-- > 0)
-				OUT(dst, dstlen, dstpos++, dst[pos++]);
+			if (dist > dstpos) {
+				errno = EILSEQ;
+				return FUNYCODE_ERR;
+			}
 		} else {
+			dist = 0;
+			len = 1;
+		}
+
+		while (len-- > 0) {
+			if (dist != 0)
+				ch = ring[(dstpos - dist) % MAXDIST];
+			ring[dstpos % MAXDIST] = ch;
 			OUT(dst, dstlen, dstpos++, ch);
 		}
 	}
@@ -259,46 +422,43 @@ encode(char *buf, size_t len, size_t pos, intmax_t bias, intmax_t delta)
 		delta = div.quot;
 	}
 
+	STAT(deltas, 1);
+	STAT(digits, i + 1);
+
 	return i + 1;
 }
 
-size_t
-wfunencode(char *enc, size_t enclen, const wchar_t *name, size_t namelen)
-{
-	wchar_t *buf = NULL;
-	size_t i, encpos, declen;
-	wchar_t n, next;
-	intmax_t bias, last;
-
-	/*
-	 * Compress the input.
-	 */
-
-	buf = malloc(namelen * sizeof(wchar_t));
-	if (buf == NULL)
-		goto fail;
-
-	namelen = compress(buf, namelen, name, namelen);
-	if (namelen == FUNYCODE_ERR)
-		goto fail;
+/*
+ * Directly output all characters that are valid in C symbols. We'll
+ * encode the rest later on. Note that leading digits always get
+ * encoded, to ensure we always produce a valid C symbol.
+ */
 
-	/*
-	 * Directly output all characters that are valid in C symbols. We'll
-	 * encode the rest later on. Note that leading digits always get
-	 * encoded, to ensure we always produce a valid C symbol.
-	 */
+static size_t
+encode_prefix(char *enc, size_t enclen, const wchar_t *buf, size_t buflen)
+{
+	size_t i, encpos;
 
 	encpos = 0;
-	for (i = 0; i < namelen; i++)
+	for (i = 0; i < buflen; i++)
 		if (!isenc(buf[i], encpos == 0))
 			OUT(enc, enclen, encpos++, wctob(buf[i]));
 
-	if (encpos == namelen)
-		goto done;
+	return encpos;
+}
 
-	/*
-	 * Encode the remaining characters as part of the suffix.
-	 */
+/*
+ * Encode the remaining characters as part of the suffix, following the
+ * encpos characters of the prefix.
+ */
+
+static size_t
+encode_suffix(char *enc, size_t enclen, size_t encpos,
+    const wchar_t *buf, size_t buflen)
+{
+	size_t i, declen, chars = 0;
+	wchar_t n, next, prev = 0;
+	intmax_t bias, last;
 
 	declen = encpos;
 	if (encpos != 0)
@@ -315,22 +475,28 @@ wfunencode(char *enc, size_t enclen, const wchar_t *name, size_t namelen)
 		bool first = true;
 		size_t decpos;
 
-		for (i = 0, decpos = 0; i < namelen; i++) {
+		for (i = 0, decpos = 0; i < buflen; i++) {
 			wchar_t ch;
 			intmax_t delta;
 
 			ch = buf[i];
+			/* a digit left as it is can equal n, as in "0f0" */
 			if (!isenc(ch, first)) {
 				first = false;
 				decpos++;
+				continue;
 			} else if (ch < n) {
 				decpos++;
-			} else if (ch > n && ch < next) {
-				next = ch;
+				continue;
+			} else if (ch > n) {
+				if (ch < next)
+					next = ch;
+				continue;
 			}
 
-			if (ch != n)
-				continue;
+			if (n != prev && ++chars > LIMIT(FUNYCODE_LIMIT_CHARS))
+				goto fail;
+			prev = n;
 
 			delta = ch * (declen + 1) + decpos - last;
 			encpos += encode(enc, enclen, encpos,
@@ -344,18 +510,87 @@ wfunencode(char *enc, size_t enclen, const wchar_t *name, size_t namelen)
 			OUT(enc, enclen, encpos++, '_');
 	}
 
-done:
-	free(buf);
+	return encpos;
+
+fail:
+	errno = E2BIG;
+
+	return FUNYCODE_ERR;
+}
+
+/*
+ * Encoder using caller-supplied workspace for the compressed name, which
+ * must be at least FUNYCODE_ENC_WSLEN(namelen) bytes and suitably aligned
+ * for wchar_t.
+ */
+
+size_t
+wfunencode_ws(char *enc, size_t enclen, const wchar_t *name, size_t namelen,
+    void *ws, size_t wslen)
+{
+	wchar_t *buf = ws;
+	size_t encpos;
+
+	STAT(enc_calls, 1);
+	STAT(enc_in, namelen);
+
+	if (namelen > LIMIT(FUNYCODE_LIMIT_LEN)) {
+		errno = E2BIG;
+		goto fail;
+	}
+	if (wslen < FUNYCODE_ENC_WSLEN(namelen)) {
+		errno = ENOBUFS;
+		goto fail;
+	}
+
+	/*
+	 * Compress the input.
+	 */
+
+	namelen = TIMED(FUNYCODE_PHASE_COMPRESS,
+	    compress(buf, namelen, name, namelen));
+	if (namelen == FUNYCODE_ERR)
+		goto fail;
+
+	encpos = TIMED(FUNYCODE_PHASE_ENC_PREFIX,
+	    encode_prefix(enc, enclen, buf, namelen));
+	if (encpos != namelen)
+		encpos = TIMED(FUNYCODE_PHASE_ENC_SUFFIX,
+		    encode_suffix(enc, enclen, encpos, buf, namelen));
+	if (encpos == FUNYCODE_ERR)
+		goto fail;
+
 	OUT(enc, enclen, encpos, '\0');
+	STAT(enc_out, encpos);
 
 	return encpos;
 
 fail:
-	free(buf);
+	STAT(errors, 1);
 
 	return FUNYCODE_ERR;
 }
 
+size_t
+wfunencode(char *enc, size_t enclen, const wchar_t *name, size_t namelen)
+{
+	wchar_t *buf;
+	size_t len;
+
+	buf = malloc(FUNYCODE_ENC_WSLEN(namelen));
+	STAT(allocs, 1);
+	if (buf == NULL) {
+		STAT(errors, 1);
+		return FUNYCODE_ERR;
+	}
+
+	len = wfunencode_ws(enc, enclen, name, namelen, buf,
+	    FUNYCODE_ENC_WSLEN(namelen));
+	free(buf);
+
+	return len;
+}
+
 size_t
 funencode_l(char *enc, size_t enclen, const char *name, size_t namelen,
     locale_t loc)
@@ -365,10 +600,12 @@ funencode_l(char *enc, size_t enclen, const char *name, size_t namelen,
 	size_t len;
 
 	wname = malloc(namelen * sizeof(wchar_t));
+	STAT(allocs, 1);
 	if (wname == NULL)
 		goto fail;
 
-	namelen = mbsnrtowcs(wname, &name, namelen, namelen, &mbs);
+	namelen = TIMED(FUNYCODE_PHASE_ENC_CONVERT,
+	    mbsnrtowcs(wname, &name, namelen, namelen, &mbs));
 	if (namelen == (size_t) -1)
 		goto fail;
 
@@ -376,6 +613,8 @@ funencode_l(char *enc, size_t enclen, const char *name, size_t namelen,
 	if (len == FUNYCODE_ERR)
 		goto fail;
 
+	free(wname);
+
 	return len;
 
 fail:
@@ -390,175 +629,1553 @@ funencode(char *enc, size_t enclen, const char *name, size_t namelen)
 	return funencode_l(enc, enclen, name, namelen, LC_GLOBAL_LOCALE);
 }
 
-
 /*
- * Decode a base 62 digit.
+ * 64-bit FNV-1a over the UTF-8 form of a name, finished with the final
+ * mix of MurmurHash3 as FNV's low bits are weak.
  */
 
-static int
-decode_value(char ch)
-{
-	if (ch >= '0' && ch <= '9')
-		return ch - '0';
-	else if (ch >= 'A' && ch <= 'Z')
-		return ch - 'A' + 10;
-	else if (ch >= 'a' && ch <= 'z')
-		return ch - 'a' + 36;
-	else
-		return -1;
-}
-
-/*
- * Decode a base 62-encoded delta.
- */
+#define FNV64_BASIS	UINT64_C(0xcbf29ce484222325)
+#define FNV64_PRIME	UINT64_C(0x00000100000001b3)
 
-static int
-decode(const char *buf, size_t len, size_t pos, intmax_t bias, intmax_t *delta)
+static inline uint64_t
+fnv64(uint64_t h, wchar_t ch)
 {
-	int i, v;
-	intmax_t t;
-	intmax_t w = 1;
-
-	*delta = 0;
-	for (i = 0; ; i++) {
-		t = (i + 1) * BASE - bias;
-		t = t < TMIN ? TMIN : t > TMAX ? TMAX : t;
-
-		v = decode_value(IN(buf, len, pos + i));
-		if (v < 0)
-			return -1;
-
-		*delta += (intmax_t) v * w;
-		w *= BASE - t;
-
-		if (v < t)
-			break;
+	uint32_t cp = ch;
+
+	if (cp < 0x80)
+		return (h ^ cp) * FNV64_PRIME;
+	else if (cp < 0x800) {
+		h = (h ^ (0xc0 | cp >> 6)) * FNV64_PRIME;
+	} else if (cp < 0x10000) {
+		h = (h ^ (0xe0 | cp >> 12)) * FNV64_PRIME;
+		h = (h ^ (0x80 | (cp >> 6 & 0x3f))) * FNV64_PRIME;
+	} else {
+		h = (h ^ (0xf0 | (cp >> 18 & 0x07))) * FNV64_PRIME;
+		h = (h ^ (0x80 | (cp >> 12 & 0x3f))) * FNV64_PRIME;
+		h = (h ^ (0x80 | (cp >> 6 & 0x3f))) * FNV64_PRIME;
 	}
 
-	return i + 1;
+	return (h ^ (0x80 | (cp & 0x3f))) * FNV64_PRIME;
 }
 
-size_t
-wfundecode(wchar_t *name, size_t namelen, const char *enc, size_t enclen)
+static inline uint64_t
+fnv64_final(uint64_t h)
 {
-	wchar_t *buf;
-	size_t buflen, namepos, encpos;
-	intmax_t bias, last;
+	h ^= h >> 33;
+	h *= UINT64_C(0xff51afd7ed558ccd);
+	h ^= h >> 33;
+	h *= UINT64_C(0xc4ceb9fe1a85ec53);
+	h ^= h >> 33;
 
-	buflen = namelen > enclen * 2 ? namelen : enclen * 2;
-	buf = malloc(buflen * sizeof(wchar_t));
-	if (buf == NULL)
-		goto fail;
+	return h;
+}
 
-	/*
-	 * Output the unencoded part of the string (the prefix). Note that
-	 * strings only containing an encoded suffix have the underscore at
-	 * the end, and strings only containing a prefix don't contain an
-	 * underscore at all.
-	 */
+/*
+ * Encode, capping the result at max characters. Names whose encoding is
+ * longer are cut short and end in two underscores and FUNYCODE_HASHLEN
+ * base 62 digits of a hash of the whole name. Having two underscores,
+ * these never decode or collide with a real encoding. If map isn't NULL,
+ * it's called with every capped result and the name it stands for.
+ */
 
-	encpos = namepos = 0;
-	if (IN(enc, enclen, enclen - 1) == '_') {
-		/* suffix only */
-		enclen--;
-	} else {
-		while (encpos < enclen && IN(enc, enclen, encpos) != '_')
-			OUT(buf, buflen, namepos++, IN(enc, enclen, encpos++));
+size_t
+funencode_max(char *enc, size_t enclen, const char *name, size_t namelen,
+    size_t max, funmapfn *map, void *arg)
+{
+	mbstate_t mbs = { 0 };
+	const char *p = name;
+	wchar_t *wname;
+	uint64_t h;
+	size_t wlen, len, i;
 
-		if (IN(enc, enclen, encpos) == '_')
-			encpos++;
+	if (max < FUNYCODE_HASHLEN + 3) {
+		errno = EINVAL;
+		return FUNYCODE_ERR;
 	}
 
-	/*
-	 * Insert all encoded characters. Handle the fact that a suffix
-	 * without a prefix can never start with a digit.
-	 */
-
-	bias = -1;
-	last = INITIAL_N * (namepos + 1);
-	if (namepos == 0)
-		last -= 10;
-
-	while (encpos < enclen) {
-		int len;
-		intmax_t delta;
-		imaxdiv_t div;
+	/* the name, followed by workspace */
+	wname = malloc(2 * FUNYCODE_ENC_WSLEN(namelen));
+	STAT(allocs, 1);
+	if (wname == NULL)
+		goto fail;
 
-		len = decode(enc, enclen, encpos,
-		    bias < 0 ? INITIAL_BIAS : bias, &delta);
-		if (len < 0)
-			goto fail;
-		encpos += len;
+	wlen = TIMED(FUNYCODE_PHASE_ENC_CONVERT,
+	    mbsnrtowcs(wname, &p, namelen, namelen, &mbs));
+	if (wlen == (size_t) -1)
+		goto fail;
 
-		div = imaxdiv(delta + last, namepos + 1);
-		if (div.rem < buflen) {
-			wmemmove(buf + div.rem + 1, buf + div.rem, buflen - div.rem - 1);
-			buf[div.rem] = (wchar_t) div.quot;
-		}
+	len = wfunencode_ws(enc, enclen, wname, wlen, wname + namelen,
+	    FUNYCODE_ENC_WSLEN(namelen));
+	if (len == FUNYCODE_ERR)
+		goto fail;
+	if (len <= max)
+		goto done;
 
-		last = div.quot * (++namepos + 1) + div.rem + 1;
-		bias = adapt(delta, namepos, bias < 0);
-	}
+	for (h = FNV64_BASIS, i = 0; i < wlen; i++)
+		h = fnv64(h, wname[i]);
+	h = fnv64_final(h);
 
-	/*
-	 * Decompress the result
-	 */
+	len = max;
+	OUT(enc, enclen, len - FUNYCODE_HASHLEN - 2, '_');
+	OUT(enc, enclen, len - FUNYCODE_HASHLEN - 1, '_');
+	for (i = 1; i <= FUNYCODE_HASHLEN; i++, h /= BASE)
+		OUT(enc, enclen, len - i, encode_value(h % BASE));
+	OUT(enc, enclen, len, '\0');
 
-	namepos = decompress(name, namelen, buf, namepos);
-	if (namepos == FUNYCODE_ERR)
-		goto fail;
+	if (map != NULL && len < enclen)
+		map(enc, len, name, namelen, arg);
 
-	free(buf);
-	OUT(name, namelen, namepos, '\0');
+done:
+	free(wname);
 
-	return namepos;
+	return len;
 
 fail:
-	free(buf);
+	free(wname);
 
 	return FUNYCODE_ERR;
 }
 
-size_t
-fundecode_l(char *name, size_t namelen, const char *enc, size_t enclen,
-    locale_t loc)
+/*
+ * Incremental encoding. A builder keeps the name so far and compresses it
+ * as it grows, stopping LOOKAHEAD characters short of the end: beyond that
+ * point, no later append can change what the compressor decides. Encoding
+ * only has to compress that last stretch (on a copy of the match finder),
+ * after which the suffix is encoded from scratch, as every delta in it
+ * depends on the positions of all smaller characters in the name.
+ *
+ * Marks save the compressor state, so a builder can be rewound to a
+ * shared prefix without compressing it again.
+ */
+
+#define LOOKAHEAD	(MAXCOPY + MINCOPY - 1)
+
+struct funmark {
+	size_t		 srclen;
+	size_t		 srcpos;
+	size_t		 dstpos;
+	mbstate_t	 mbs;
+	struct matcher	 m;
+};
+
+struct funbuilder {
+	wchar_t		*src;		/* name so far */
+	wchar_t		*dst;		/* compressed, up to srcpos */
+	size_t		 srclen;
+	size_t		 cap;
+	size_t		 srcpos;
+	size_t		 dstpos;
+	mbstate_t	 mbs;		/* for multibyte appends */
+	struct matcher	 m;
+	struct funmark	*marks;
+	size_t		 nmarks;
+	size_t		 markcap;
+};
+
+struct funbuilder *
+funbuilder_new(void)
+{
+	struct funbuilder *b;
+
+	b = calloc(1, sizeof(*b));
+	STAT(allocs, 1);
+	if (b == NULL)
+		return NULL;
+
+	matcher_reset(&b->m);
+
+	return b;
+}
+
+void
+funbuilder_free(struct funbuilder *b)
+{
+	if (b == NULL)
+		return;
+
+	free(b->src);
+	free(b->dst);
+	free(b->marks);
+	free(b);
+}
+
+static int
+reserve(struct funbuilder *b, size_t len)
+{
+	size_t cap;
+	void *src, *dst;
+
+	if (b->srclen + len <= b->cap)
+		return 0;
+
+	for (cap = b->cap == 0 ? 64 : b->cap; b->srclen + len > cap; cap *= 2)
+		;
+
+	src = realloc(b->src, cap * sizeof(wchar_t));
+	STAT(allocs, 1);
+	if (src == NULL)
+		return -1;
+	b->src = src;
+
+	dst = realloc(b->dst, cap * sizeof(wchar_t));
+	STAT(allocs, 1);
+	if (dst == NULL)
+		return -1;
+	b->dst = dst;
+	b->cap = cap;
+
+	return 0;
+}
+
+static int
+advance(struct funbuilder *b)
+{
+	if (b->srclen < LOOKAHEAD || b->srcpos >= b->srclen - LOOKAHEAD)
+		return 0;
+
+	return TIMED(FUNYCODE_PHASE_COMPRESS,
+	    compress_run(&b->m, b->dst, b->cap, &b->srcpos, &b->dstpos,
+	    b->src, b->srclen, b->srclen - LOOKAHEAD));
+}
+
+int
+wfunbuilder_append(struct funbuilder *b, const wchar_t *frag, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if ((frag[i] & ~(COPYMASK | DISTMASK)) == BACKREF) {
+			errno = EILSEQ;
+			return -1;
+		}
+
+	if (reserve(b, len) < 0)
+		return -1;
+
+	memcpy(b->src + b->srclen, frag, len * sizeof(wchar_t));
+	b->srclen += len;
+
+	return advance(b);
+}
+
+/*
+ * Append a multibyte fragment; a character may be split across appends.
+ */
+
+int
+funbuilder_append(struct funbuilder *b, const char *frag, size_t len)
+{
+	mbstate_t mbs = b->mbs;
+	size_t i, n;
+
+	if (reserve(b, len) < 0)
+		return -1;
+
+	n = TIMED(FUNYCODE_PHASE_ENC_CONVERT,
+	    mbsnrtowcs(b->src + b->srclen, &frag, len, len, &mbs));
+	if (n == (size_t) -1)
+		return -1;
+
+	for (i = 0; i < n; i++)
+		if ((b->src[b->srclen + i] & ~(COPYMASK | DISTMASK)) ==
+		    BACKREF) {
+			errno = EILSEQ;
+			return -1;
+		}
+
+	b->mbs = mbs;
+	b->srclen += n;
+
+	return advance(b);
+}
+
+/*
+ * Save the current state; returns a mark to rewind to.
+ */
+
+size_t
+funbuilder_mark(struct funbuilder *b)
+{
+	struct funmark *mark;
+
+	if (b->nmarks == b->markcap) {
+		size_t cap = b->markcap == 0 ? 4 : b->markcap * 2;
+
+		mark = realloc(b->marks, cap * sizeof(*mark));
+		STAT(allocs, 1);
+		if (mark == NULL)
+			return FUNYCODE_ERR;
+		b->marks = mark;
+		b->markcap = cap;
+	}
+
+	mark = &b->marks[b->nmarks];
+	mark->srclen = b->srclen;
+	mark->srcpos = b->srcpos;
+	mark->dstpos = b->dstpos;
+	mark->mbs = b->mbs;
+	mark->m = b->m;
+
+	return b->nmarks++;
+}
+
+/*
+ * Go back to a mark, dropping any marks made after it.
+ */
+
+int
+funbuilder_rewind(struct funbuilder *b, size_t mark)
+{
+	const struct funmark *m;
+
+	if (mark >= b->nmarks) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	m = &b->marks[mark];
+	b->srclen = m->srclen;
+	b->srcpos = m->srcpos;
+	b->dstpos = m->dstpos;
+	b->mbs = m->mbs;
+	b->m = m->m;
+	b->nmarks = mark + 1;
+
+	return 0;
+}
+
+/*
+ * Encode the name built so far; this doesn't change the builder. Returns
+ * the same as funencode().
+ */
+
+size_t
+funbuilder_encode(struct funbuilder *b, char *enc, size_t enclen)
+{
+	struct matcher m;
+	size_t srcpos, dstpos, encpos;
+
+	STAT(enc_calls, 1);
+	STAT(enc_in, b->srclen);
+
+	if (b->srclen > LIMIT(FUNYCODE_LIMIT_LEN)) {
+		errno = E2BIG;
+		goto fail;
+	}
+
+	m = b->m;
+	srcpos = b->srcpos;
+	dstpos = b->dstpos;
+	if (TIMED(FUNYCODE_PHASE_COMPRESS,
+	    compress_run(&m, b->dst, b->cap, &srcpos, &dstpos, b->src,
+	    b->srclen, b->srclen)) < 0)
+		goto fail;
+
+	encpos = TIMED(FUNYCODE_PHASE_ENC_PREFIX,
+	    encode_prefix(enc, enclen, b->dst, dstpos));
+	if (encpos != dstpos)
+		encpos = TIMED(FUNYCODE_PHASE_ENC_SUFFIX,
+		    encode_suffix(enc, enclen, encpos, b->dst, dstpos));
+	if (encpos == FUNYCODE_ERR)
+		goto fail;
+
+	OUT(enc, enclen, encpos, '\0');
+	STAT(enc_out, encpos);
+
+	return encpos;
+
+fail:
+	STAT(errors, 1);
+
+	return FUNYCODE_ERR;
+}
+
+
+/*
+ * Decode a base 62 digit.
+ */
+
+static int
+decode_value(char ch)
+{
+	if (ch >= '0' && ch <= '9')
+		return ch - '0';
+	else if (ch >= 'A' && ch <= 'Z')
+		return ch - 'A' + 10;
+	else if (ch >= 'a' && ch <= 'z')
+		return ch - 'a' + 36;
+	else
+		return -1;
+}
+
+/*
+ * Add digit i of a base 62-encoded delta, accumulating its value in
+ * *delta and the weight of the next digit in *w. Returns 1 if it was the
+ * last digit, 0 if more follow and -1 if ch isn't a digit or the delta
+ * doesn't fit.
+ */
+
+static inline int
+decode_digit(char ch, int i, intmax_t bias, intmax_t *delta, intmax_t *w)
+{
+	int v;
+	intmax_t t, d;
+
+	t = (i + 1) * BASE - bias;
+	t = t < TMIN ? TMIN : t > TMAX ? TMAX : t;
+
+	v = decode_value(ch);
+	if (v < 0)
+		return -1;
+
+	if (__builtin_mul_overflow((intmax_t) v, *w, &d) ||
+	    __builtin_add_overflow(*delta, d, delta))
+		return -1;
+	if (v < t)
+		return 1;
+
+	if (__builtin_mul_overflow(*w, BASE - t, w))
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Decode a base 62-encoded delta.
+ */
+
+static int
+decode(const char *buf, size_t len, size_t pos, intmax_t bias, intmax_t *delta)
+{
+	int i, r;
+	intmax_t w = 1;
+
+	*delta = 0;
+	for (i = 0; (r = decode_digit(IN(buf, len, pos + i), i, bias, delta,
+	    &w)) == 0; i++)
+		;
+
+	return r < 0 ? -1 : i + 1;
+}
+
+/*
+ * Output the unencoded part of the string (the prefix). Note that
+ * strings only containing an encoded suffix have the underscore at
+ * the end, and strings only containing a prefix don't contain an
+ * underscore at all. On return, *encpos and *enclen delimit the suffix.
+ */
+
+static size_t
+decode_prefix(wchar_t *buf, size_t buflen, const char *enc, size_t *enclen,
+    size_t *encpos)
+{
+	size_t namepos;
+
+	*encpos = namepos = 0;
+	if (IN(enc, *enclen, *enclen - 1) == '_') {
+		/* suffix only */
+		(*enclen)--;
+	} else {
+		while (*encpos < *enclen && IN(enc, *enclen, *encpos) != '_')
+			OUT(buf, buflen, namepos++, IN(enc, *enclen, (*encpos)++));
+
+		if (IN(enc, *enclen, *encpos) == '_')
+			(*encpos)++;
+	}
+
+	return namepos;
+}
+
+/*
+ * Insert all encoded characters into the namepos characters of the
+ * prefix. Handle the fact that a suffix without a prefix can never start
+ * with a digit. As the encoder works its way up through the code points,
+ * the number of distinct characters is the number of times the decoded
+ * code point changes.
+ *
+ * This must remain async-signal-safe, for fundecode_ws().
+ */
+
+struct suffix {
+	intmax_t	 bias;
+	intmax_t	 last;
+	intmax_t	 prev;		/* last code point inserted */
+	size_t		 chars;		/* distinct code points so far */
+};
+
+static void
+suffix_init(struct suffix *s, size_t namepos)
+{
+	s->bias = -1;
+	s->last = INITIAL_N * (namepos + 1);
+	if (namepos == 0)
+		s->last -= 10;
+	s->prev = -1;
+	s->chars = 0;
+}
+
+#define SUFFIX_BIAS(s)	((s)->bias < 0 ? INITIAL_BIAS : (s)->bias)
+
+/*
+ * Work out the character given by a delta and where it goes among the
+ * namepos characters decoded so far.
+ */
+
+static int
+suffix_step(struct suffix *s, size_t namepos, intmax_t delta, intmax_t *quot,
+    intmax_t *rem)
+{
+	intmax_t sum;
+
+	if (__builtin_add_overflow(delta, s->last, &sum)) {
+		errno = EILSEQ;
+		return -1;
+	}
+
+	*quot = sum / (intmax_t) (namepos + 1);
+	*rem = sum % (intmax_t) (namepos + 1);
+	if (*quot > WCHAR_MAX || *quot > 0x10ffff) {
+		errno = EILSEQ;
+		return -1;
+	}
+	if (namepos + 1 > LIMIT(FUNYCODE_LIMIT_LEN) ||
+	    (*quot != s->prev && ++s->chars > LIMIT(FUNYCODE_LIMIT_CHARS))) {
+		errno = E2BIG;
+		return -1;
+	}
+	s->prev = *quot;
+
+	s->last = *quot * (intmax_t) (namepos + 2) + *rem + 1;
+	s->bias = adapt(delta, namepos + 1, s->bias < 0);
+
+	return 0;
+}
+
+/*
+ * Insert the character given by a delta; returns the new name length.
+ */
+
+static size_t
+suffix_insert(struct suffix *s, wchar_t *buf, size_t buflen, size_t namepos,
+    intmax_t delta)
+{
+	intmax_t quot, rem;
+
+	if (suffix_step(s, namepos, delta, &quot, &rem) < 0)
+		return FUNYCODE_ERR;
+
+	/* only move what has been decoded so far */
+	if (rem < buflen) {
+		wmemmove(buf + rem + 1, buf + rem,
+		    (namepos < buflen ? namepos : buflen - 1) - rem);
+		buf[rem] = (wchar_t) quot;
+	}
+
+	return namepos + 1;
+}
+
+static size_t
+decode_suffix(wchar_t *buf, size_t buflen, size_t namepos,
+    const char *enc, size_t enclen, size_t encpos)
+{
+	struct suffix s;
+
+	suffix_init(&s, namepos);
+	while (encpos < enclen) {
+		int len;
+		intmax_t delta;
+
+		len = decode(enc, enclen, encpos, SUFFIX_BIAS(&s), &delta);
+		if (len < 0) {
+			errno = EILSEQ;
+			return FUNYCODE_ERR;
+		}
+		encpos += len;
+
+		namepos = suffix_insert(&s, buf, buflen, namepos, delta);
+		if (namepos == FUNYCODE_ERR)
+			return FUNYCODE_ERR;
+	}
+
+	return namepos;
+}
+
+size_t
+wfundecode(wchar_t *name, size_t namelen, const char *enc, size_t enclen)
+{
+	wchar_t *buf;
+	size_t buflen, namepos, encpos;
+
+	buflen = namelen > enclen * 2 ? namelen : enclen * 2;
+	STAT(dec_calls, 1);
+	STAT(dec_in, enclen);
+
+	buf = malloc(buflen * sizeof(wchar_t));
+	STAT(allocs, 1);
+	if (buf == NULL)
+		goto fail;
+
+	namepos = TIMED(FUNYCODE_PHASE_DEC_PREFIX,
+	    decode_prefix(buf, buflen, enc, &enclen, &encpos));
+	if (namepos > LIMIT(FUNYCODE_LIMIT_LEN))
+		goto toobig;
+
+	namepos = TIMED(FUNYCODE_PHASE_DEC_SUFFIX,
+	    decode_suffix(buf, buflen, namepos, enc, enclen, encpos));
+	if (namepos == FUNYCODE_ERR)
+		goto fail;
+
+	/*
+	 * Decompress the result
+	 */
+
+	namepos = TIMED(FUNYCODE_PHASE_DECOMPRESS,
+	    decompress(name, namelen, buf, namepos));
+	if (namepos == FUNYCODE_ERR)
+		goto fail;
+	if (namepos > LIMIT(FUNYCODE_LIMIT_LEN))
+		goto toobig;
+
+	free(buf);
+	OUT(name, namelen, namepos, '\0');
+	STAT(dec_out, namepos);
+
+	return namepos;
+
+toobig:
+	errno = E2BIG;
+fail:
+	free(buf);
+	STAT(errors, 1);
+
+	return FUNYCODE_ERR;
+}
+
+size_t
+fundecode_l(char *name, size_t namelen, const char *enc, size_t enclen,
+    locale_t loc)
+{
+	mbstate_t mbs = { 0 };
+	wchar_t *wname, *p;
+	size_t wnamelen, wlen, len;
+
+	wnamelen = namelen > enclen * 2 ? namelen : enclen * 2;
+	wname = malloc(wnamelen * sizeof(wchar_t));
+	STAT(allocs, 1);
+	if (wname == NULL)
+		goto fail;
+
+	wlen = wfundecode(wname, wnamelen, enc, enclen);
+	if (wlen == FUNYCODE_ERR)
+		goto fail;
+
+	/* names that compress well can be longer than guessed */
+	if (wlen > wnamelen) {
+		free(wname);
+		wnamelen = wlen;
+		wname = malloc(wnamelen * sizeof(wchar_t));
+		STAT(allocs, 1);
+		if (wname == NULL)
+			goto fail;
+
+		wlen = wfundecode(wname, wnamelen, enc, enclen);
+		if (wlen == FUNYCODE_ERR)
+			goto fail;
+	}
+
+	p = wname;
+	len = TIMED(FUNYCODE_PHASE_DEC_CONVERT,
+	    wcsnrtombs(NULL, (const wchar_t **) &p,
+		wnamelen < wlen ? wnamelen : wlen, 0, &mbs));
+
+	p = wname;
+	if (TIMED(FUNYCODE_PHASE_DEC_CONVERT,
+		wcsnrtombs(name, (const wchar_t **) &p,
+		    wnamelen < wlen ? wnamelen : wlen, namelen,
+		    &mbs)) == (size_t) -1)
+		goto fail;
+
+	free(wname);
+	OUT(name, namelen, len, '\0');
+
+	return len;
+
+fail:
+	free(wname);
+
+	return FUNYCODE_ERR;
+}
+
+size_t
+fundecode(char *name, size_t namelen, const char *enc, size_t enclen)
+{
+	return fundecode_l(name, namelen, enc, enclen, LC_GLOBAL_LOCALE);
+}
+
+size_t
+fungetlimit(int which)
+{
+	if (which < 0 || (size_t) which >= nitems(limits)) {
+		errno = EINVAL;
+		return FUNYCODE_ERR;
+	}
+
+	return LIMIT(which);
+}
+
+int
+funsetlimit(int which, size_t limit)
+{
+	if (which < 0 || (size_t) which >= nitems(limits)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	__atomic_store_n(&limits[which], limit, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+int
+funycode_stats(struct funycode_stats *st, int reset)
+{
+#ifdef FUNYCODE_STATS
+	unsigned long long *src, *dst;
+	size_t i;
+
+	src = (unsigned long long *) &stats;
+	dst = (unsigned long long *) st;
+	for (i = 0; i < sizeof(stats) / sizeof(*src); i++) {
+		unsigned long long v;
+
+		v = reset ? __atomic_exchange_n(&src[i], 0, __ATOMIC_RELAXED) :
+		    __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+		if (dst != NULL)
+			dst[i] = v;
+	}
+
+	return 0;
+#else
+	errno = ENOTSUP;
+
+	return -1;
+#endif
+}
+
+/*
+ * Decompress directly into UTF-8, keeping the last MAXDIST characters in
+ * a ring buffer to resolve matches from.
+ */
+
+static size_t
+decompress_utf8(char *dst, size_t dstlen, const wchar_t *src, size_t srclen,
+    wchar_t *ring)
+{
+	size_t srcpos, dstpos, ringpos;
+
+	srcpos = dstpos = ringpos = 0;
+	while (srcpos < srclen) {
+		wchar_t ch;
+		size_t dist, len;
+
+		ch = src[srcpos++];
+		if ((ch & ~(COPYMASK | DISTMASK)) == BACKREF) {
+			dist = ((ch & DISTMASK) >> COPYBITS) + MINDIST;
+			len = (ch & COPYMASK) + MINCOPY;
+			if (dist > ringpos)
+				goto fail;
+		} else {
+			dist = 0;
+			len = 1;
+		}
+
+		while (len-- > 0) {
+			uint32_t cp;
+			char u[4];
+			size_t i, n;
+
+			cp = dist == 0 ? (uint32_t) ch :
+			    (uint32_t) ring[(ringpos - dist) % MAXDIST];
+			ring[ringpos++ % MAXDIST] = cp;
+
+			if (cp < 0x80) {
+				u[0] = cp;
+				n = 1;
+			} else if (cp < 0x800) {
+				u[0] = 0xc0 | cp >> 6;
+				u[1] = 0x80 | (cp & 0x3f);
+				n = 2;
+			} else if (cp < 0x10000) {
+				if (cp >= 0xd800 && cp <= 0xdfff)
+					goto fail;
+				u[0] = 0xe0 | cp >> 12;
+				u[1] = 0x80 | (cp >> 6 & 0x3f);
+				u[2] = 0x80 | (cp & 0x3f);
+				n = 3;
+			} else if (cp < 0x110000) {
+				u[0] = 0xf0 | cp >> 18;
+				u[1] = 0x80 | (cp >> 12 & 0x3f);
+				u[2] = 0x80 | (cp >> 6 & 0x3f);
+				u[3] = 0x80 | (cp & 0x3f);
+				n = 4;
+			} else {
+				goto fail;
+			}
+
+			/* never output partial characters */
+			if (dstpos + n <= dstlen)
+				for (i = 0; i < n; i++)
+					dst[dstpos + i] = u[i];
+			dstpos += n;
+		}
+	}
+
+	return dstpos;
+
+fail:
+	errno = EILSEQ;
+
+	return FUNYCODE_ERR;
+}
+
+/*
+ * Async-signal-safe decoder: doesn't allocate, doesn't depend on the
+ * locale and only uses caller-supplied workspace, which must be at least
+ * FUNYCODE_WSLEN(enclen) bytes and suitably aligned for wchar_t.
+ */
+
+size_t
+fundecode_ws(char *name, size_t namelen, const char *enc, size_t enclen,
+    void *ws, size_t wslen)
+{
+	wchar_t *buf, *ring;
+	size_t buflen, namepos, encpos, len;
+
+	if (wslen < FUNYCODE_WSLEN(enclen)) {
+		errno = ENOBUFS;
+		return FUNYCODE_ERR;
+	}
+
+	/* every character takes at least one byte to encode */
+	ring = ws;
+	buf = ring + MAXDIST;
+	buflen = enclen;
+
+	namepos = decode_prefix(buf, buflen, enc, &enclen, &encpos);
+	namepos = decode_suffix(buf, buflen, namepos, enc, enclen, encpos);
+	if (namepos == FUNYCODE_ERR)
+		return FUNYCODE_ERR;
+
+	len = decompress_utf8(name, namelen, buf, namepos, ring);
+	if (len == FUNYCODE_ERR)
+		return FUNYCODE_ERR;
+
+	OUT(name, namelen, len, '\0');
+
+	return len;
+}
+
+/*
+ * Streaming decoder, fed the encoded name in pieces of any size. Until the
+ * first underscore is followed by something else, it isn't known whether
+ * the bytes so far are the prefix or a whole suffix ("abc" versus "abc_"),
+ * so those are held as they are; from then on, suffix digits are decoded
+ * as they arrive and every character is inserted into the (compressed)
+ * name as soon as its delta is complete. The encoded name itself is never
+ * kept. Nothing can be output before the end, as the next delta may still
+ * insert a character anywhere, back references included. The result is
+ * UTF-8, as with fundecode_ws().
+ */
+
+enum {
+	DEC_PENDING,			/* no underscore yet */
+	DEC_SEP,			/* underscore was the last byte */
+	DEC_SUFFIX,			/* decoding the suffix */
+	DEC_DONE,			/* finished */
+};
+
+struct fundecoder {
+	char		*pend;		/* bytes before the underscore */
+	size_t		 pendlen;
+	size_t		 pendcap;
+	wchar_t		*buf;		/* compressed name so far */
+	size_t		 namepos;
+	size_t		 cap;
+	int		 state;
+	int		 error;		/* errno of the first failure */
+	struct suffix	 s;
+	int		 digit;		/* delta being decoded */
+	intmax_t	 delta;
+	intmax_t	 w;
+	wchar_t		 ring[MAXDIST];
+};
+
+struct fundecoder *
+fundecoder_new(void)
 {
-	mbstate_t mbs = { 0 };
-	wchar_t *wname, *p;
-	size_t wnamelen, wlen, len;
+	struct fundecoder *d;
 
-	wnamelen = namelen > enclen * 2 ? namelen : enclen * 2;
-	wname = malloc(wnamelen * sizeof(wchar_t));
-	if (wname == NULL)
-		goto fail;
+	d = calloc(1, sizeof(*d));
+	STAT(allocs, 1);
 
-	wlen = wfundecode(wname, wnamelen, enc, enclen);
-	if (wlen == FUNYCODE_ERR)
+	return d;
+}
+
+void
+fundecoder_free(struct fundecoder *d)
+{
+	if (d == NULL)
+		return;
+
+	free(d->pend);
+	free(d->buf);
+	free(d);
+}
+
+/*
+ * Start on a new name, keeping the buffers.
+ */
+
+void
+fundecoder_reset(struct fundecoder *d)
+{
+	d->pendlen = d->namepos = 0;
+	d->state = DEC_PENDING;
+	d->error = 0;
+}
+
+static int
+fundecoder_grow(void **p, size_t *cap, size_t len, size_t size)
+{
+	size_t newcap;
+	void *new;
+
+	if (len <= *cap)
+		return 0;
+
+	for (newcap = *cap == 0 ? 64 : *cap; len > newcap; newcap *= 2)
+		;
+
+	new = realloc(*p, newcap * size);
+	STAT(allocs, 1);
+	if (new == NULL)
+		return -1;
+
+	*p = new;
+	*cap = newcap;
+
+	return 0;
+}
+
+/*
+ * Start decoding the suffix, following namepos characters of prefix.
+ */
+
+static int
+fundecoder_start(struct fundecoder *d, size_t namepos)
+{
+	size_t i;
+
+	if (namepos > LIMIT(FUNYCODE_LIMIT_LEN)) {
+		errno = E2BIG;
+		return -1;
+	}
+	if (fundecoder_grow((void **) &d->buf, &d->cap, namepos + 1,
+	    sizeof(wchar_t)) < 0)
+		return -1;
+
+	for (i = 0; i < namepos; i++)
+		d->buf[i] = (unsigned char) d->pend[i];
+	d->namepos = namepos;
+
+	suffix_init(&d->s, namepos);
+	d->digit = 0;
+	d->delta = 0;
+	d->w = 1;
+
+	return 0;
+}
+
+static int
+fundecoder_digit(struct fundecoder *d, char ch)
+{
+	int r;
+
+	r = decode_digit(ch, d->digit, SUFFIX_BIAS(&d->s), &d->delta, &d->w);
+	if (r < 0) {
+		errno = EILSEQ;
+		return -1;
+	} else if (r == 0) {
+		d->digit++;
+		return 0;
+	}
+
+	if (fundecoder_grow((void **) &d->buf, &d->cap, d->namepos + 1,
+	    sizeof(wchar_t)) < 0)
+		return -1;
+
+	d->namepos = suffix_insert(&d->s, d->buf, d->cap, d->namepos,
+	    d->delta);
+	if (d->namepos == FUNYCODE_ERR)
+		return -1;
+
+	d->digit = 0;
+	d->delta = 0;
+	d->w = 1;
+
+	return 0;
+}
+
+int
+fundecoder_feed(struct fundecoder *d, const char *enc, size_t len)
+{
+	const char *end = enc + len, *u;
+	size_t n;
+
+	STAT(dec_in, len);
+
+	if (d->error != 0)
 		goto fail;
+	if (d->state == DEC_DONE) {
+		errno = EINVAL;
+		goto error;
+	}
 
-	p = wname;
-	len = wcsnrtombs(NULL, (const wchar_t **) &p,
-	    wnamelen < wlen ? wnamelen : wlen, 0, &mbs);
+	while (enc < end) {
+		switch (d->state) {
+		case DEC_PENDING:
+			u = memchr(enc, '_', end - enc);
+			n = (u != NULL ? u : end) - enc;
+			if (d->pendlen + n > LIMIT(FUNYCODE_LIMIT_LEN)) {
+				errno = E2BIG;
+				goto error;
+			}
+			if (fundecoder_grow((void **) &d->pend, &d->pendcap,
+			    d->pendlen + n, 1) < 0)
+				goto error;
+
+			memcpy(d->pend + d->pendlen, enc, n);
+			d->pendlen += n;
+			enc += n;
+			if (u != NULL) {
+				d->state = DEC_SEP;
+				enc++;
+			}
+			break;
 
-	p = wname;
-	if (wcsnrtombs(name, (const wchar_t **) &p,
-		    wnamelen < wlen ? wnamelen : wlen, namelen,
-		    &mbs) == (size_t) -1)
+		case DEC_SEP:
+			/* more follows, so what came before is the prefix */
+			if (fundecoder_start(d, d->pendlen) < 0)
+				goto error;
+			d->state = DEC_SUFFIX;
+			/* FALLTHROUGH */
+
+		case DEC_SUFFIX:
+			for (; enc < end; enc++)
+				if (fundecoder_digit(d, *enc) < 0)
+					goto error;
+			break;
+		}
+	}
+
+	return 0;
+
+error:
+	d->error = errno;
+fail:
+	errno = d->error;
+	STAT(errors, 1);
+
+	return -1;
+}
+
+/*
+ * Finish decoding and produce the name; returns the same as fundecode_ws().
+ * This can be repeated with a larger buffer if the result didn't fit.
+ */
+
+size_t
+fundecoder_finish(struct fundecoder *d, char *name, size_t namelen)
+{
+	size_t i, len;
+
+	if (d->error != 0)
 		goto fail;
 
-	free(wname);
+	switch (d->state) {
+	case DEC_PENDING:
+		/* prefix only */
+		if (fundecoder_start(d, d->pendlen) < 0)
+			goto error;
+		break;
+
+	case DEC_SEP:
+		/* suffix only */
+		if (fundecoder_start(d, 0) < 0)
+			goto error;
+		for (i = 0; i < d->pendlen; i++)
+			if (fundecoder_digit(d, d->pend[i]) < 0)
+				goto error;
+		/* FALLTHROUGH */
+
+	case DEC_SUFFIX:
+		if (d->digit != 0) {
+			/* truncated delta */
+			errno = EILSEQ;
+			goto error;
+		}
+		break;
+	}
+
+	if (d->state != DEC_DONE) {
+		STAT(dec_calls, 1);
+		STAT(dec_out, d->namepos);
+		d->state = DEC_DONE;
+	}
+
+	len = TIMED(FUNYCODE_PHASE_DECOMPRESS,
+	    decompress_utf8(name, namelen, d->buf, d->namepos, d->ring));
+	if (len == FUNYCODE_ERR)
+		goto error;
+
 	OUT(name, namelen, len, '\0');
 
 	return len;
 
+error:
+	d->error = errno;
 fail:
-	free(wname);
+	errno = d->error;
+	STAT(errors, 1);
+
+	return FUNYCODE_ERR;
+}
+
+/*
+ * Check whether a string is well-formed funycode, as the encoder would
+ * produce it, without decoding it: the separator must be placed right,
+ * the prefix can only hold letters and digits and can't start with a
+ * digit, every delta must be complete and fit, and every character must
+ * be a code point or a back reference. Back references can only reach
+ * past the start of the name when among its first MAXDIST characters, so
+ * only those are kept, to check those references against.
+ */
+
+static bool
+isalnumc(char ch)
+{
+	return (ch >= '0' && ch <= '9') || (ch >= 'A' && ch <= 'Z') ||
+	    (ch >= 'a' && ch <= 'z');
+}
+
+/*
+ * Check a name and tally what it's made of; returns -1 if it's invalid.
+ */
+
+static int
+inspect(struct funinfo *fi, const char *enc, size_t enclen)
+{
+	wchar_t head[MAXDIST];		/* first characters of the name */
+	struct suffix s;
+	const char *end = enc + enclen, *prefix, *suffix, *p;
+	size_t namepos, i, n, len;
+	intmax_t delta, w, quot, rem;
+	int digit, r;
+
+	memset(fi, 0, sizeof(*fi));
+	if (enclen == 0)
+		return 0;
+	if (enc[0] == '_')
+		goto invalid;
+
+	if ((p = memchr(enc, '_', enclen)) == NULL)
+		prefix = suffix = end;
+	else if (p == end - 1) {
+		/* suffix only */
+		prefix = suffix = enc;
+		end = p;
+	} else {
+		prefix = p;
+		suffix = p + 1;
+	}
+
+	/* leading digits are always encoded, but a suffix can start with one */
+	if (prefix > enc && enc[0] >= '0' && enc[0] <= '9')
+		goto invalid;
+
+	for (p = enc; p < prefix; p++)
+		if (!isalnumc(*p))
+			goto invalid;
+	namepos = prefix - enc;
+	if (namepos > LIMIT(FUNYCODE_LIMIT_LEN)) {
+		errno = E2BIG;
+		return -1;
+	}
+	for (i = 0; i < namepos && i < MAXDIST; i++)
+		head[i] = enc[i];
+	fi->prefix = namepos;
+
+	suffix_init(&s, namepos);
+	digit = 0;
+	delta = 0;
+	w = 1;
+	for (p = suffix; p < end; p++) {
+		r = decode_digit(*p, digit, SUFFIX_BIAS(&s), &delta, &w);
+		if (r < 0)
+			goto invalid;
+		else if (r == 0) {
+			digit++;
+			continue;
+		}
+
+		if (suffix_step(&s, namepos, delta, &quot, &rem) < 0)
+			return -1;
+		if (rem < MAXDIST) {
+			n = namepos < MAXDIST ? namepos : MAXDIST - 1;
+			wmemmove(head + rem + 1, head + rem, n - rem);
+			head[rem] = (wchar_t) quot;
+		}
+		if ((quot & ~(COPYMASK | DISTMASK)) == BACKREF) {
+			fi->matches++;
+			fi->saved += (quot & COPYMASK) + MINCOPY - 1;
+		}
+
+		namepos++;
+		fi->deltas++;
+		fi->digits += digit + 1;
+		digit = 0;
+		delta = 0;
+		w = 1;
+	}
+	if (digit != 0)
+		goto invalid;
+
+	for (i = len = 0; i < namepos && i < MAXDIST; i++) {
+		if ((head[i] & ~(COPYMASK | DISTMASK)) != BACKREF)
+			len++;
+		else if (((head[i] & DISTMASK) >> COPYBITS) + MINDIST > len)
+			goto invalid;
+		else
+			len += (head[i] & COPYMASK) + MINCOPY;
+	}
+
+	fi->complen = namepos;
+	fi->len = namepos + fi->saved;
+
+	return 0;
+
+invalid:
+	errno = EILSEQ;
+
+	return -1;
+}
+
+int
+funvalid(const char *enc, size_t enclen)
+{
+	struct funinfo fi;
+
+	return inspect(&fi, enc, enclen) == 0;
+}
+
+/*
+ * Describe an encoded name; fails with EILSEQ if it isn't valid.
+ */
+
+int
+funinfo(struct funinfo *fi, const char *enc, size_t enclen)
+{
+	return inspect(fi, enc, enclen);
+}
+
+/*
+ * Check a batch of names; lens may be NULL for NUL-terminated ones, and
+ * valid NULL if only the number of valid names is wanted.
+ */
+
+size_t
+funvalid_batch(const char *const *encs, const size_t *lens, size_t n,
+    unsigned char *valid)
+{
+	size_t i, nvalid = 0;
+	int v;
+
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n)
+			__builtin_prefetch(encs[i + 1]);
+
+		v = funvalid(encs[i], lens != NULL ? lens[i] : strlen(encs[i]));
+		if (valid != NULL)
+			valid[i] = v;
+		nvalid += v;
+	}
+
+	return nvalid;
+}
+
+/*
+ * Lazy decoder, producing one character at a time. Only the prefix and
+ * suffix are decoded up front; decompression keeps just the last MAXDIST
+ * characters, which is all back references can reach.
+ */
+
+struct lazy {
+	wchar_t		*buf;		/* compressed name */
+	size_t		 len;
+	size_t		 pos;
+	size_t		 out;		/* characters produced so far */
+	size_t		 dist;		/* back reference being copied */
+	size_t		 copy;
+	wchar_t		 ring[MAXDIST];
+	wchar_t		 small[64];
+};
+
+static int
+lazy_init(struct lazy *l, const char *enc, size_t enclen)
+{
+	size_t buflen, encpos, n;
+
+	/* every character takes at least one byte to encode */
+	buflen = enclen;
+	if (buflen <= nitems(l->small))
+		l->buf = l->small;
+	else {
+		l->buf = malloc(buflen * sizeof(wchar_t));
+		STAT(allocs, 1);
+		if (l->buf == NULL)
+			return -1;
+	}
+
+	n = decode_prefix(l->buf, buflen, enc, &enclen, &encpos);
+	n = decode_suffix(l->buf, buflen, n, enc, enclen, encpos);
+	if (n == FUNYCODE_ERR) {
+		if (l->buf != l->small)
+			free(l->buf);
+		return -1;
+	}
+
+	l->len = n;
+	l->pos = l->out = l->copy = 0;
+
+	return 0;
+}
+
+static void
+lazy_free(struct lazy *l)
+{
+	if (l->buf != l->small)
+		free(l->buf);
+}
+
+/*
+ * Get the next character; returns 1 if there was one, 0 at the end and -1
+ * on an invalid back reference.
+ */
+
+static int
+lazy_next(struct lazy *l, wchar_t *ch)
+{
+	wchar_t c;
+
+	if (l->copy > 0) {
+		l->copy--;
+		c = l->ring[(l->out - l->dist) % MAXDIST];
+	} else if (l->pos == l->len) {
+		return 0;
+	} else if (((c = l->buf[l->pos++]) & ~(COPYMASK | DISTMASK)) ==
+	    BACKREF) {
+		l->dist = ((c & DISTMASK) >> COPYBITS) + MINDIST;
+		l->copy = (c & COPYMASK) + MINCOPY - 1;
+		if (l->dist > l->out) {
+			errno = EILSEQ;
+			return -1;
+		}
+		c = l->ring[(l->out - l->dist) % MAXDIST];
+	}
+
+	l->ring[l->out++ % MAXDIST] = c;
+	*ch = c;
+
+	return 1;
+}
+
+/*
+ * Compare two encoded names by the code points of their decoded forms,
+ * decoding only as far as the first difference. Names without any encoded
+ * characters are compared directly. Names that fail to decode order after
+ * all others, and among themselves by their encoded form.
+ */
+
+static bool
+lazy_valid(struct lazy *l, int r)
+{
+	wchar_t ch;
+
+	while (r > 0)
+		r = lazy_next(l, &ch);
+	lazy_free(l);
+
+	return r == 0;
+}
+
+int
+funycmp(const char *a, size_t alen, const char *b, size_t blen)
+{
+	struct lazy la, lb;
+	wchar_t ca = 0, cb = 0;
+	bool va, vb;
+	int ra, rb, r;
+
+	if (memchr(a, '_', alen) == NULL && memchr(b, '_', blen) == NULL)
+		goto direct;
+
+	/* -2 means there is nothing to free */
+	ra = lazy_init(&la, a, alen) == 0 ? 1 : -2;
+	rb = lazy_init(&lb, b, blen) == 0 ? 1 : -2;
+	while (ra > 0 && rb > 0 && ca == cb) {
+		ra = lazy_next(&la, &ca);
+		rb = lazy_next(&lb, &cb);
+	}
+
+	if (ra >= 0 && rb >= 0) {
+		lazy_free(&la);
+		lazy_free(&lb);
+		if (ra == 0 || rb == 0)
+			return ra - rb;
+		return ca < cb ? -1 : 1;
+	}
+
+	/* decode the rest to find out which of them are valid */
+	va = ra != -2 && lazy_valid(&la, ra);
+	vb = rb != -2 && lazy_valid(&lb, rb);
+	if (va != vb)
+		return va ? -1 : 1;
+
+direct:
+	if ((r = memcmp(a, b, alen < blen ? alen : blen)) != 0)
+		return r;
+
+	return alen < blen ? -1 : alen > blen;
+}
+
+/*
+ * Comparison function for qsort() and friends, on arrays of pointers to
+ * NUL-terminated encoded names.
+ */
+
+int
+funycmp_qsort(const void *a, const void *b)
+{
+	const char *sa = *(const char *const *) a;
+	const char *sb = *(const char *const *) b;
+
+	return funycmp(sa, strlen(sa), sb, strlen(sb));
+}
+
+/*
+ * Sort key for radix sorting: the first keylen code points of the decoded
+ * name, padded with zeroes. Names with equal keys still need funycmp() to
+ * break the tie. Returns the length of the decoded name in characters.
+ */
+
+size_t
+funkey(uint32_t *key, size_t keylen, const char *enc, size_t enclen)
+{
+	struct lazy l;
+	wchar_t ch;
+	size_t i;
+	int r = 1;
+
+	if (lazy_init(&l, enc, enclen) < 0)
+		return FUNYCODE_ERR;
+
+	for (i = 0; i < keylen && (r = lazy_next(&l, &ch)) > 0; i++)
+		key[i] = ch;
+	if (r < 0)
+		goto fail;
+	for (; i < keylen; i++)
+		key[i] = 0;
+
+	/* count the rest without producing it, starting with any copy left */
+	l.out += l.copy;
+	l.copy = 0;
+	for (; l.pos < l.len; l.pos++) {
+		ch = l.buf[l.pos];
+		if ((ch & ~(COPYMASK | DISTMASK)) == BACKREF) {
+			if (((ch & DISTMASK) >> COPYBITS) + MINDIST > l.out)
+				goto fail;
+			l.out += (ch & COPYMASK) + MINCOPY;
+		} else
+			l.out++;
+	}
+
+	lazy_free(&l);
+
+	return l.out;
+
+fail:
+	lazy_free(&l);
+	errno = EILSEQ;
 
 	return FUNYCODE_ERR;
 }
 
+/*
+ * Hash of the decoded name, computed without converting it: the same as
+ * the hash funencode_max() puts at the end of capped names, so a capped
+ * name can be matched against the full encoding it stands for. Names
+ * without encoded characters are hashed as they are.
+ */
+
+int
+funhash(uint64_t *hash, const char *enc, size_t enclen)
+{
+	struct lazy l;
+	wchar_t ch;
+	uint64_t h = FNV64_BASIS;
+	size_t i;
+	int r;
+
+	for (i = 0; i < enclen && isalnumc(enc[i]); i++)
+		h = fnv64(h, enc[i]);
+	if (i == enclen)
+		goto done;
+
+	if (lazy_init(&l, enc, enclen) < 0)
+		return -1;
+	for (h = FNV64_BASIS; (r = lazy_next(&l, &ch)) > 0;)
+		h = fnv64(h, ch);
+	lazy_free(&l);
+	if (r < 0)
+		return -1;
+
+done:
+	*hash = fnv64_final(h);
+
+	return 0;
+}
+
+/*
+ * Hash a batch of names; lens may be NULL for NUL-terminated ones. Names
+ * that fail to decode get a hash of 0. Returns the number of names hashed.
+ */
+
 size_t
-fundecode(char *name, size_t namelen, const char *enc, size_t enclen)
+funhash_batch(uint64_t *hashes, const char *const *encs, const size_t *lens,
+    size_t n)
 {
-	return fundecode_l(name, namelen, enc, enclen, LC_GLOBAL_LOCALE);
+	size_t i, nhashed = 0;
+
+	for (i = 0; i < n; i++) {
+		if (i + 1 < n)
+			__builtin_prefetch(encs[i + 1]);
+
+		if (funhash(&hashes[i], encs[i],
+		    lens != NULL ? lens[i] : strlen(encs[i])) == 0)
+			nhashed++;
+		else
+			hashes[i] = 0;
+	}
+
+	return nhashed;
 }
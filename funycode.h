@@ -18,14 +18,158 @@
 #define FUNYCODE_H
 
 #include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* the interface stays visible when building with -fvisibility=hidden */
+#ifdef __GNUC__
+#pragma GCC visibility push(default)
+#endif
 
 #define FUNYCODE_ERR	((size_t) -1)
 
+/*
+ * Workspace needed by fundecode_ws(), for the compressed name and the last
+ * 128 characters decompressed, and by wfunencode_ws().
+ */
+#define FUNYCODE_WSLEN(enclen)	(((enclen) + 128) * sizeof(wchar_t))
+#define FUNYCODE_ENC_WSLEN(namelen) ((namelen) * sizeof(wchar_t))
+
+/* length of the hash that ends names capped by funencode_max() */
+#define FUNYCODE_HASHLEN	11
+
+/*
+ * Per-name limits set by funsetlimit() are process-wide. Set them before
+ * starting threads that convert names; changing them later is safe, but a
+ * call already under way may run to the old limits.
+ */
+#define FUNYCODE_LIMIT_LEN	0	/* maximum name length, in characters */
+#define FUNYCODE_LIMIT_CHARS	1	/* maximum distinct encoded characters */
+
+#define FUNYCODE_PHASE_ENC_CONVERT	0
+#define FUNYCODE_PHASE_COMPRESS		1
+#define FUNYCODE_PHASE_ENC_PREFIX	2
+#define FUNYCODE_PHASE_ENC_SUFFIX	3
+#define FUNYCODE_PHASE_DEC_PREFIX	4
+#define FUNYCODE_PHASE_DEC_SUFFIX	5
+#define FUNYCODE_PHASE_DECOMPRESS	6
+#define FUNYCODE_PHASE_DEC_CONVERT	7
+#define FUNYCODE_NPHASES		8
+
+/*
+ * Runtime statistics; only collected if the library was built with
+ * -DFUNYCODE_STATS. Name lengths are in characters, encoded lengths in
+ * bytes.
+ */
+
+struct funycode_stats {
+	unsigned long long	 enc_calls;	/* encoder calls */
+	unsigned long long	 enc_in;	/* name characters encoded */
+	unsigned long long	 enc_out;	/* encoded bytes produced */
+	unsigned long long	 dec_calls;	/* decoder calls */
+	unsigned long long	 dec_in;	/* encoded bytes decoded */
+	unsigned long long	 dec_out;	/* name characters produced */
+	unsigned long long	 errors;	/* failed calls */
+	unsigned long long	 matches;	/* compression matches */
+	unsigned long long	 saved;		/* characters saved by matches */
+	unsigned long long	 deltas;	/* suffix deltas encoded */
+	unsigned long long	 digits;	/* suffix digits encoded */
+	unsigned long long	 allocs;	/* memory allocations */
+	unsigned long long	 cycles[FUNYCODE_NPHASES];
+};
+
+/*
+ * What an encoded name is made of, as reported by funinfo(). Lengths are
+ * in characters; matches are back references, each saving its length
+ * less one.
+ */
+
+struct funinfo {
+	size_t		 len;		/* decoded length */
+	size_t		 complen;	/* length after compression */
+	size_t		 prefix;	/* characters in the prefix */
+	size_t		 deltas;	/* characters in the suffix */
+	size_t		 digits;	/* suffix digits */
+	size_t		 matches;	/* back references */
+	size_t		 saved;		/* characters saved by them */
+};
+
 size_t		 funencode(char *enc, size_t enclen,
 		     const char *name, size_t namelen);
 size_t		 fundecode(char *name, size_t namelen,
 		     const char *enc, size_t enclen);
 
+typedef void	 funmapfn(const char *enc, size_t enclen,
+		     const char *name, size_t namelen, void *arg);
+size_t		 funencode_max(char *enc, size_t enclen,
+		     const char *name, size_t namelen, size_t max,
+		     funmapfn *map, void *arg);
+
+int		 funycmp(const char *a, size_t alen, const char *b, size_t blen);
+int		 funycmp_qsort(const void *a, const void *b);
+size_t		 funkey(uint32_t *key, size_t keylen,
+		     const char *enc, size_t enclen);
+
+size_t		 fungetlimit(int which);
+int		 funsetlimit(int which, size_t limit);
+int		 funycode_stats(struct funycode_stats *st, int reset);
+
+size_t		 fundecode_ws(char *name, size_t namelen,
+		     const char *enc, size_t enclen, void *ws, size_t wslen);
+
+int		 funvalid(const char *enc, size_t enclen);
+int		 funinfo(struct funinfo *fi, const char *enc, size_t enclen);
+size_t		 funvalid_batch(const char *const *encs, const size_t *lens,
+		     size_t n, unsigned char *valid);
+int		 funhash(uint64_t *hash, const char *enc, size_t enclen);
+size_t		 funhash_batch(uint64_t *hashes, const char *const *encs,
+		     const size_t *lens, size_t n);
+
+/*
+ * Build a name from fragments; the result is the same as encoding the
+ * whole name with funencode().
+ */
+
+struct funbuilder;
+
+struct funbuilder *funbuilder_new(void);
+void		 funbuilder_free(struct funbuilder *b);
+int		 funbuilder_append(struct funbuilder *b,
+		     const char *frag, size_t len);
+size_t		 funbuilder_mark(struct funbuilder *b);
+int		 funbuilder_rewind(struct funbuilder *b, size_t mark);
+size_t		 funbuilder_encode(struct funbuilder *b,
+		     char *enc, size_t enclen);
+
+/*
+ * Decode a name fed in pieces of any size; the result is the same as
+ * decoding the whole name with fundecode_ws().
+ */
+
+struct fundecoder;
+
+struct fundecoder *fundecoder_new(void);
+void		 fundecoder_free(struct fundecoder *d);
+void		 fundecoder_reset(struct fundecoder *d);
+int		 fundecoder_feed(struct fundecoder *d,
+		     const char *enc, size_t len);
+size_t		 fundecoder_finish(struct fundecoder *d,
+		     char *name, size_t namelen);
+
+/*
+ * Look up symbols by their unencoded UTF-8 name. Results are cached per
+ * handle; use fundlclose() instead of dlclose() to drop them. RTLD_NEXT
+ * doesn't work, as it would be relative to the library itself.
+ */
+
+void		*fundlsym(void *handle, const char *name);
+size_t		 fundlprefetch(void *handle, const char *const *names,
+		     size_t n, void **addrs);
+int		 fundlclose(void *handle);
+
 #ifdef LC_GLOBAL_LOCALE
 size_t		 funencode_l(char *enc, size_t enclen,
 		     const char *name, size_t namelen, locale_t loc);
@@ -38,6 +182,19 @@ size_t		 wfunencode(char *enc, size_t enclen,
 		     const wchar_t *name, size_t namelen);
 size_t		 wfundecode(wchar_t *name, size_t namelen,
 		     const char *enc, size_t enclen);
+size_t		 wfunencode_ws(char *enc, size_t enclen,
+		     const wchar_t *name, size_t namelen, void *ws, size_t wslen);
+int		 wfunbuilder_append(struct funbuilder *b,
+		     const wchar_t *frag, size_t len);
+void		*wfundlsym(void *handle, const wchar_t *name);
+#endif
+
+#ifdef __GNUC__
+#pragma GCC visibility pop
+#endif
+
+#ifdef __cplusplus
+}
 #endif
 
 #endif /* FUNYCODE_H */
@@ -0,0 +1,759 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef FUNYCODE_HPP
+#define FUNYCODE_HPP
+
+/*
+ * C++17 interface. Narrow names are always UTF-8, independent of the
+ * locale; wide and UTF-32 names are code points. Errors are thrown as
+ * std::system_error. Scratch space comes from a memory resource, the
+ * default one unless given.
+ */
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <cwchar>
+#include <memory_resource>
+#include <new>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include "funycode.h"
+
+namespace funycode {
+
+static_assert(sizeof(wchar_t) >= sizeof(char32_t),
+    "funycode needs wchar_t to hold any code point");
+
+/*
+ * String with inline storage for typical symbol names, falling back to
+ * its memory resource for longer ones. Always NUL-terminated.
+ */
+
+class small_string {
+public:
+	static constexpr std::size_t inline_size = 64;
+
+	explicit small_string(std::pmr::memory_resource *mr =
+	    std::pmr::get_default_resource()) noexcept
+	    : mr_(mr), ptr_(buf_), size_(0), cap_(inline_size - 1)
+	{
+		buf_[0] = '\0';
+	}
+
+	small_string(const small_string &s)
+	    : small_string(s.mr_)
+	{
+		std::memcpy(room(s.size_), s.ptr_, s.size_ + 1);
+		size_ = s.size_;
+	}
+
+	small_string(small_string &&s) noexcept
+	    : mr_(s.mr_), size_(s.size_), cap_(s.cap_)
+	{
+		if (s.ptr_ == s.buf_) {
+			ptr_ = buf_;
+			std::memcpy(buf_, s.buf_, s.size_ + 1);
+		} else {
+			ptr_ = s.ptr_;
+			s.ptr_ = s.buf_;
+			s.cap_ = inline_size - 1;
+		}
+		s.size_ = 0;
+		s.buf_[0] = '\0';
+	}
+
+	small_string &
+	operator=(const small_string &s)
+	{
+		if (this != &s) {
+			std::memcpy(room(s.size_), s.ptr_, s.size_ + 1);
+			size_ = s.size_;
+		}
+		return *this;
+	}
+
+	small_string &
+	operator=(small_string &&s) noexcept
+	{
+		if (this != &s) {
+			this->~small_string();
+			new (this) small_string(std::move(s));
+		}
+		return *this;
+	}
+
+	~small_string()
+	{
+		if (ptr_ != buf_)
+			mr_->deallocate(ptr_, cap_ + 1, 1);
+	}
+
+	const char *data() const noexcept { return ptr_; }
+	const char *c_str() const noexcept { return ptr_; }
+	std::size_t size() const noexcept { return size_; }
+	bool empty() const noexcept { return size_ == 0; }
+	const char *begin() const noexcept { return ptr_; }
+	const char *end() const noexcept { return ptr_ + size_; }
+
+	std::string_view view() const noexcept { return { ptr_, size_ }; }
+	operator std::string_view() const noexcept { return view(); }
+
+	/*
+	 * Room for n characters plus a NUL, after which commit() sets the
+	 * length. The contents are not kept.
+	 */
+
+	char *
+	room(std::size_t n)
+	{
+		if (n > cap_) {
+			char *p = static_cast<char *>(mr_->allocate(n + 1, 1));
+
+			if (ptr_ != buf_)
+				mr_->deallocate(ptr_, cap_ + 1, 1);
+			ptr_ = p;
+			cap_ = n;
+		}
+
+		return ptr_;
+	}
+
+	void
+	commit(std::size_t n) noexcept
+	{
+		size_ = n;
+		ptr_[n] = '\0';
+	}
+
+private:
+	std::pmr::memory_resource *mr_;
+	char		*ptr_;
+	std::size_t	 size_;
+	std::size_t	 cap_;
+	char		 buf_[inline_size];
+};
+
+namespace detail {
+
+inline std::size_t
+check(std::size_t n, const char *what)
+{
+	if (n == FUNYCODE_ERR)
+		throw std::system_error(errno, std::generic_category(), what);
+
+	return n;
+}
+
+/*
+ * Scratch space, given back when going out of scope.
+ */
+
+class scratch {
+public:
+	scratch(std::pmr::memory_resource *mr, std::size_t size)
+	    : mr_(mr), size_(size != 0 ? size : 1),
+	      p_(mr->allocate(size_, alignof(wchar_t)))
+	{
+	}
+
+	scratch(const scratch &) = delete;
+	scratch &operator=(const scratch &) = delete;
+
+	~scratch() { mr_->deallocate(p_, size_, alignof(wchar_t)); }
+
+	void *get() const noexcept { return p_; }
+	std::size_t size() const noexcept { return size_; }
+
+private:
+	std::pmr::memory_resource *mr_;
+	std::size_t	 size_;
+	void		*p_;
+};
+
+/*
+ * Destinations for results: room(n) gives space for n characters and a
+ * NUL, commit(n) sets the final length.
+ */
+
+template <class String>
+struct append_to {
+	String		&s;
+	std::size_t	 old;
+
+	explicit append_to(String &str) : s(str), old(str.size()) { }
+
+	char *
+	room(std::size_t n)
+	{
+		/* writing the terminating NUL over itself is fine */
+		s.resize(old + n);
+		return s.data() + old;
+	}
+
+	void commit(std::size_t n) { s.resize(old + n); }
+};
+
+/*
+ * Run a conversion, guessing the result length first and retrying once
+ * if the guess was too small.
+ */
+
+template <class Dest, class Fn>
+void
+run(Dest &dest, std::size_t guess, Fn fn, const char *what)
+{
+	std::size_t n;
+
+	n = check(fn(dest.room(guess), guess + 1), what);
+	if (n > guess)
+		check(fn(dest.room(n), n + 1), what);
+	dest.commit(n);
+}
+
+/*
+ * UTF-8 to code points, independent of the locale.
+ */
+
+inline std::size_t
+utf8_decode(wchar_t *dst, std::string_view src)
+{
+	const unsigned char *p =
+	    reinterpret_cast<const unsigned char *>(src.data());
+	const unsigned char *end = p + src.size();
+	std::size_t n, len;
+	char32_t c, min;
+
+	for (n = 0; p < end; n++) {
+		if (*p < 0x80) {
+			dst[n] = *p++;
+			continue;
+		} else if (*p >= 0xc2 && *p < 0xe0) {
+			c = *p & 0x1f;
+			len = 1;
+			min = 0x80;
+		} else if (*p >= 0xe0 && *p < 0xf0) {
+			c = *p & 0x0f;
+			len = 2;
+			min = 0x800;
+		} else if (*p >= 0xf0 && *p < 0xf5) {
+			c = *p & 0x07;
+			len = 3;
+			min = 0x10000;
+		} else
+			goto fail;
+
+		if (static_cast<std::size_t>(end - p) <= len)
+			goto fail;
+		for (std::size_t i = 1; i <= len; i++) {
+			if ((p[i] & 0xc0) != 0x80)
+				goto fail;
+			c = (c << 6) | (p[i] & 0x3f);
+		}
+		if (c < min || c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+			goto fail;
+
+		dst[n] = c;
+		p += len + 1;
+	}
+
+	return n;
+
+fail:
+	throw std::system_error(EILSEQ, std::generic_category(), "funycode");
+}
+
+template <class CharT>
+inline std::basic_string<CharT>
+utf8_to(std::string_view src, std::pmr::memory_resource *mr)
+{
+	std::basic_string<CharT> s;
+	std::size_t n;
+
+	s.resize(src.size());
+	if constexpr (std::is_same_v<CharT, wchar_t>) {
+		n = utf8_decode(s.data(), src);
+	} else {
+		scratch ws(mr, src.size() * sizeof(wchar_t));
+		wchar_t *w = static_cast<wchar_t *>(ws.get());
+
+		n = utf8_decode(w, src);
+		for (std::size_t i = 0; i < n; i++)
+			s[i] = static_cast<CharT>(w[i]);
+	}
+	s.resize(n);
+
+	return s;
+}
+
+/*
+ * Encode code points held in workspace, leaving room after them for the
+ * encoder's own scratch.
+ */
+
+template <class Dest>
+void
+encode_wide(Dest &dest, const wchar_t *name, std::size_t len, void *ws,
+    std::size_t wslen)
+{
+	run(dest, len * 2 + 8, [&](char *enc, std::size_t enclen) {
+		return wfunencode_ws(enc, enclen, name, len, ws, wslen);
+	}, "wfunencode_ws");
+}
+
+template <class Dest>
+void
+encode(Dest &dest, std::string_view name, std::pmr::memory_resource *mr)
+{
+	std::size_t len = name.size();
+	scratch ws(mr, 2 * FUNYCODE_ENC_WSLEN(len));
+	wchar_t *w = static_cast<wchar_t *>(ws.get());
+
+	len = utf8_decode(w, name);
+	encode_wide(dest, w, len, w + name.size(),
+	    FUNYCODE_ENC_WSLEN(name.size()));
+}
+
+template <class Dest>
+void
+encode(Dest &dest, std::wstring_view name, std::pmr::memory_resource *mr)
+{
+	scratch ws(mr, FUNYCODE_ENC_WSLEN(name.size()));
+
+	encode_wide(dest, name.data(), name.size(), ws.get(), ws.size());
+}
+
+template <class Dest>
+void
+encode(Dest &dest, std::u32string_view name, std::pmr::memory_resource *mr)
+{
+	std::size_t len = name.size();
+	scratch ws(mr, 2 * FUNYCODE_ENC_WSLEN(len));
+	wchar_t *w = static_cast<wchar_t *>(ws.get());
+
+	for (std::size_t i = 0; i < len; i++)
+		w[i] = name[i];
+	encode_wide(dest, w, len, w + len, FUNYCODE_ENC_WSLEN(len));
+}
+
+template <class Dest>
+void
+decode(Dest &dest, std::string_view enc, std::pmr::memory_resource *mr)
+{
+	scratch ws(mr, FUNYCODE_WSLEN(enc.size()));
+
+	run(dest, enc.size() * 2 + 16, [&](char *name, std::size_t namelen) {
+		return fundecode_ws(name, namelen, enc.data(), enc.size(),
+		    ws.get(), ws.size());
+	}, "fundecode_ws");
+}
+
+} /* namespace detail */
+
+/*
+ * Encode a UTF-8, wide or UTF-32 name.
+ */
+
+template <class View>
+inline small_string
+encode(const View &name,
+    std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+{
+	small_string s(mr);
+
+	detail::encode(s, name, mr);
+
+	return s;
+}
+
+inline small_string
+encode(const char *name,
+    std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+{
+	return encode(std::string_view(name), mr);
+}
+
+/*
+ * Decode to UTF-8.
+ */
+
+inline small_string
+decode(std::string_view enc,
+    std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+{
+	small_string s(mr);
+
+	detail::decode(s, enc, mr);
+
+	return s;
+}
+
+inline std::u32string
+decode_u32(std::string_view enc,
+    std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+{
+	return detail::utf8_to<char32_t>(decode(enc, mr), mr);
+}
+
+inline std::wstring
+decode_wide(std::string_view enc,
+    std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+{
+	return detail::utf8_to<wchar_t>(decode(enc, mr), mr);
+}
+
+/*
+ * Append the result to a std::string or std::pmr::string, converting
+ * straight into its buffer.
+ */
+
+template <class View, class Traits, class Alloc>
+inline void
+encode_append(std::basic_string<char, Traits, Alloc> &out, const View &name,
+    std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+{
+	detail::append_to<std::basic_string<char, Traits, Alloc>> dest(out);
+
+	detail::encode(dest, name, mr);
+}
+
+template <class Traits, class Alloc>
+inline void
+decode_append(std::basic_string<char, Traits, Alloc> &out,
+    std::string_view enc,
+    std::pmr::memory_resource *mr = std::pmr::get_default_resource())
+{
+	detail::append_to<std::basic_string<char, Traits, Alloc>> dest(out);
+
+	detail::decode(dest, enc, mr);
+}
+
+#if __cplusplus >= 202002L
+
+/*
+ * Compile-time encoding, e.g. funycode::encode<u8"føø">() or, using
+ * funycode::literals, u8"føø"_funy. This duplicates the encoder in
+ * funycode.c (which must stay in step with it) in constexpr form;
+ * test-ct.cc checks the two against each other.
+ */
+
+namespace detail::ct {
+
+inline constexpr long long BASE = 62;
+inline constexpr long long TMIN = 1;
+inline constexpr long long TMAX = 52;
+inline constexpr long long SKEW = 208;
+inline constexpr long long DAMP = 700;
+inline constexpr long long INITIAL_BIAS = BASE * 2 - TMAX / 2;
+inline constexpr char32_t INITIAL_N = 32;
+inline constexpr char32_t END = 0x7fffffff;	/* WCHAR_MAX */
+
+inline constexpr char32_t BACKREF = 0xd800;
+inline constexpr int COPYBITS = 4;
+inline constexpr std::size_t MINCOPY = 4;
+inline constexpr std::size_t MAXCOPY = (1 << COPYBITS) - 1 + MINCOPY;
+inline constexpr int DISTBITS = 7;
+inline constexpr std::size_t MINDIST = 1;
+inline constexpr std::size_t MAXDIST = (1 << DISTBITS) - 1 + MINDIST;
+inline constexpr int HASHBITS = 9;
+
+template <class CharT>
+constexpr std::size_t
+code_points(const CharT *s, std::size_t len, char32_t *out)
+{
+	std::size_t i, n;
+
+	for (i = n = 0; i < len; n++) {
+		char32_t c = static_cast<std::make_unsigned_t<CharT>>(s[i++]);
+
+		if constexpr (sizeof(CharT) == 1) {
+			std::size_t more = c < 0x80 ? 0 : c < 0xc2 ? 4 :
+			    c < 0xe0 ? 1 : c < 0xf0 ? 2 : c < 0xf5 ? 3 : 4;
+			char32_t min = more == 1 ? 0x80 : more == 2 ? 0x800 :
+			    0x10000;
+
+			if (more == 4 || len - i < more)
+				throw "invalid UTF-8";
+			if (more > 0)
+				c &= 0x3f >> more;
+			for (; more > 0; more--, i++) {
+				if ((s[i] & 0xc0) != 0x80)
+					throw "invalid UTF-8";
+				c = c << 6 | (s[i] & 0x3f);
+			}
+			if (c >= 0x80 && c < min)
+				throw "invalid UTF-8";
+		} else if constexpr (sizeof(CharT) == 2) {
+			if (c >= 0xd800 && c < 0xdc00 && i < len &&
+			    s[i] >= 0xdc00 && s[i] < 0xe000)
+				c = 0x10000 + ((c - 0xd800) << 10) +
+				    (s[i++] - 0xdc00);
+		}
+
+		if (c > 0x10ffff || (c >= 0xd800 && c < 0xe000))
+			throw "invalid code point";
+		out[n] = c;
+	}
+
+	return n;
+}
+
+constexpr std::size_t
+hash(const char32_t *buf)
+{
+	std::uint32_t h = 0x84222325;
+
+	h = (h ^ buf[0]) * 0x1b3;
+	h = (h ^ buf[1]) * 0x1b3;
+	h = (h ^ buf[2]) * 0x1b3;
+
+	return h & ((1 << HASHBITS) - 1);
+}
+
+constexpr std::size_t
+compress(char32_t *dst, const char32_t *src, std::size_t srclen)
+{
+	std::size_t tab[1 << HASHBITS] = {};	/* position + 1 */
+	std::size_t srcpos = 0, dstpos = 0;
+
+	while (srcpos + (MINCOPY - 1) < srclen) {
+		std::size_t h, cand, len = 0, end;
+
+		h = hash(src + srcpos);
+		cand = tab[h] != 0 ? tab[h] - 1 : 0;
+		if (srcpos - cand >= MINDIST && srcpos - cand <= MAXDIST)
+			while (len < MAXCOPY && srcpos + len < srclen &&
+			    src[srcpos + len] == src[cand + len])
+				len++;
+
+		if (len >= MINCOPY)
+			dst[dstpos++] = BACKREF + (len - MINCOPY) +
+			    ((srcpos - cand - MINDIST) << COPYBITS);
+		else {
+			dst[dstpos++] = src[srcpos];
+			len = 1;
+		}
+
+		end = srcpos + len;
+		tab[h] = ++srcpos;
+		for (; srcpos < end && srcpos + (MINCOPY - 1) < srclen; srcpos++)
+			tab[hash(src + srcpos)] = srcpos + 1;
+		srcpos = end;
+	}
+
+	while (srcpos < srclen)
+		dst[dstpos++] = src[srcpos++];
+
+	return dstpos;
+}
+
+constexpr bool
+isenc(char32_t ch, bool first)
+{
+	if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z'))
+		return false;
+
+	return first || ch < '0' || ch > '9';
+}
+
+constexpr char
+encode_value(long long val)
+{
+	return val <= 9 ? '0' + val : val <= 35 ? 'A' + val - 10 :
+	    'a' + val - 36;
+}
+
+constexpr long long
+adapt(long long delta, std::size_t outpos, bool first)
+{
+	long long k;
+
+	delta = (first ? delta / DAMP : delta / 2) +
+	    delta / static_cast<long long>(outpos);
+	for (k = 0; delta > (BASE - TMIN) * TMAX / 2; k += BASE)
+		delta /= BASE - TMIN;
+
+	return k + (BASE - TMIN + 1) * delta / (delta + SKEW);
+}
+
+constexpr void
+out(char *enc, std::size_t enclen, std::size_t pos, char ch)
+{
+	if (pos < enclen)
+		enc[pos] = ch;
+}
+
+constexpr std::size_t
+encode_delta(char *enc, std::size_t enclen, std::size_t pos, long long bias,
+    long long delta)
+{
+	std::size_t i;
+
+	for (i = 0; ; i++) {
+		long long t = (i + 1) * BASE - bias;
+
+		t = t < TMIN ? TMIN : t > TMAX ? TMAX : t;
+		if (delta < t) {
+			out(enc, enclen, pos + i, encode_value(delta));
+			break;
+		}
+
+		out(enc, enclen, pos + i,
+		    encode_value((delta - t) % (BASE - t) + t));
+		delta = (delta - t) / (BASE - t);
+	}
+
+	return i + 1;
+}
+
+constexpr std::size_t
+encode(char *enc, std::size_t enclen, const char32_t *buf, std::size_t buflen)
+{
+	std::size_t i, encpos = 0, declen;
+	char32_t n, next;
+	long long bias = -1, last;
+
+	/* prefix */
+	for (i = 0; i < buflen; i++)
+		if (!isenc(buf[i], encpos == 0))
+			out(enc, enclen, encpos++, static_cast<char>(buf[i]));
+	if (encpos == buflen) {
+		out(enc, enclen, encpos, '\0');
+		return encpos;
+	}
+
+	/* suffix */
+	declen = encpos;
+	if (encpos != 0)
+		out(enc, enclen, encpos++, '_');
+
+	last = INITIAL_N * static_cast<long long>(declen + 1);
+	if (encpos == 0)
+		last -= 10;
+
+	for (n = INITIAL_N, next = END; n < END; n = next, next = END) {
+		bool first = true;
+		std::size_t decpos = 0;
+
+		for (i = 0; i < buflen; i++) {
+			char32_t ch = buf[i];
+			long long delta;
+
+			if (!isenc(ch, first)) {
+				first = false;
+				decpos++;
+				continue;
+			} else if (ch < n) {
+				decpos++;
+				continue;
+			} else if (ch > n) {
+				if (ch < next)
+					next = ch;
+				continue;
+			}
+
+			delta = static_cast<long long>(ch) *
+			    static_cast<long long>(declen + 1) +
+			    static_cast<long long>(decpos) - last;
+			encpos += encode_delta(enc, enclen, encpos,
+			    bias < 0 ? INITIAL_BIAS : bias, delta);
+
+			last = static_cast<long long>(ch) *
+			    static_cast<long long>(++declen + 1) +
+			    static_cast<long long>(++decpos);
+			bias = adapt(delta, declen, bias < 0);
+		}
+
+		if (next == END && first)
+			out(enc, enclen, encpos++, '_');
+	}
+
+	out(enc, enclen, encpos, '\0');
+
+	return encpos;
+}
+
+template <class CharT, std::size_t N>
+constexpr std::size_t
+encode(const CharT (&s)[N], char *enc, std::size_t enclen)
+{
+	char32_t name[N] = {}, buf[N] = {};
+	std::size_t len;
+
+	len = code_points(s, N - 1, name);
+	len = compress(buf, name, len);
+
+	return encode(enc, enclen, buf, len);
+}
+
+} /* namespace detail::ct */
+
+template <class CharT, std::size_t N>
+struct fixed_string {
+	CharT	 s[N];
+
+	consteval
+	fixed_string(const CharT (&str)[N])
+	{
+		for (std::size_t i = 0; i < N; i++)
+			s[i] = str[i];
+	}
+};
+
+template <std::size_t N>
+struct encoded_name {
+	char	 str[N + 1];
+
+	constexpr const char *c_str() const noexcept { return str; }
+	constexpr const char *data() const noexcept { return str; }
+	constexpr std::size_t size() const noexcept { return N; }
+	constexpr std::string_view view() const noexcept { return { str, N }; }
+	constexpr operator std::string_view() const noexcept { return view(); }
+};
+
+template <fixed_string S>
+consteval auto
+encode()
+{
+	constexpr std::size_t len = detail::ct::encode(S.s, nullptr, 0);
+	encoded_name<len> name = {};
+
+	detail::ct::encode(S.s, name.str, len + 1);
+
+	return name;
+}
+
+namespace literals {
+
+template <fixed_string S>
+consteval auto
+operator""_funy()
+{
+	return funycode::encode<S>();
+}
+
+} /* namespace literals */
+
+#endif /* __cplusplus >= 202002L */
+
+} /* namespace funycode */
+
+#endif /* FUNYCODE_HPP */
@@ -0,0 +1,814 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "funycode.h"
+#include "cache.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <elf.h>
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wchar.h>
+
+/*
+ * Section headers and symbols, in a form independent of the ELF class.
+ */
+
+struct elf {
+	const char	*path;
+	unsigned char	*base;
+	size_t		 size;
+	int		 class;
+	int		 type;
+	size_t		 ehsize;
+	size_t		 shoff;
+	size_t		 shnum;
+	size_t		 shentsize;
+	size_t		 shstrndx;
+};
+
+struct shdr {
+	uint32_t	 name;
+	uint32_t	 type;
+	size_t		 offset;
+	size_t		 size;
+	uint32_t	 link;
+	size_t		 addralign;
+	size_t		 entsize;
+};
+
+static void
+elf_open(struct elf *elf, const char *path)
+{
+	struct stat st;
+	unsigned char *base;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		err(1, "%s", path);
+	if (fstat(fd, &st) < 0)
+		err(1, "%s", path);
+	if ((size_t) st.st_size < sizeof(Elf32_Ehdr))
+		errx(1, "%s: not an ELF file", path);
+
+	base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED)
+		err(1, "%s: mmap", path);
+	close(fd);
+
+	if (memcmp(base, ELFMAG, SELFMAG) != 0)
+		errx(1, "%s: not an ELF file", path);
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (base[EI_DATA] != ELFDATA2LSB)
+#else
+	if (base[EI_DATA] != ELFDATA2MSB)
+#endif
+		errx(1, "%s: unsupported byte order", path);
+
+	elf->path = path;
+	elf->base = base;
+	elf->size = st.st_size;
+	elf->class = base[EI_CLASS];
+
+	if (elf->class == ELFCLASS64 && elf->size >= sizeof(Elf64_Ehdr)) {
+		const Elf64_Ehdr *eh = (const Elf64_Ehdr *) base;
+
+		elf->type = eh->e_type;
+		elf->ehsize = sizeof(*eh);
+		elf->shoff = eh->e_shoff;
+		elf->shnum = eh->e_shnum;
+		elf->shentsize = eh->e_shentsize;
+		elf->shstrndx = eh->e_shstrndx;
+	} else if (elf->class == ELFCLASS32) {
+		const Elf32_Ehdr *eh = (const Elf32_Ehdr *) base;
+
+		elf->type = eh->e_type;
+		elf->ehsize = sizeof(*eh);
+		elf->shoff = eh->e_shoff;
+		elf->shnum = eh->e_shnum;
+		elf->shentsize = eh->e_shentsize;
+		elf->shstrndx = eh->e_shstrndx;
+	} else {
+		errx(1, "%s: unsupported ELF class", path);
+	}
+
+	if (elf->shentsize < (elf->class == ELFCLASS64 ?
+	    sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr)) ||
+	    elf->shoff > elf->size ||
+	    elf->shnum > (elf->size - elf->shoff) / elf->shentsize)
+		errx(1, "%s: bad section header table", path);
+}
+
+static void
+elf_shdr(const struct elf *elf, size_t i, struct shdr *sh)
+{
+	const unsigned char *p = elf->base + elf->shoff + i * elf->shentsize;
+
+	if (elf->class == ELFCLASS64) {
+		const Elf64_Shdr *s = (const Elf64_Shdr *) p;
+
+		sh->name = s->sh_name;
+		sh->type = s->sh_type;
+		sh->offset = s->sh_offset;
+		sh->size = s->sh_size;
+		sh->link = s->sh_link;
+		sh->addralign = s->sh_addralign;
+		sh->entsize = s->sh_entsize;
+	} else {
+		const Elf32_Shdr *s = (const Elf32_Shdr *) p;
+
+		sh->name = s->sh_name;
+		sh->type = s->sh_type;
+		sh->offset = s->sh_offset;
+		sh->size = s->sh_size;
+		sh->link = s->sh_link;
+		sh->addralign = s->sh_addralign;
+		sh->entsize = s->sh_entsize;
+	}
+
+	if (sh->type != SHT_NOBITS &&
+	    (sh->offset > elf->size || sh->size > elf->size - sh->offset))
+		errx(1, "%s: section %zu out of bounds", elf->path, i);
+}
+
+/*
+ * Update the name, offset and size of section header p, in a copy of the
+ * section header table.
+ */
+
+static void
+elf_setshdr(const struct elf *elf, unsigned char *p, const struct shdr *sh)
+{
+	if (elf->class == ELFCLASS64) {
+		Elf64_Shdr *s = (Elf64_Shdr *) p;
+
+		s->sh_name = sh->name;
+		s->sh_offset = sh->offset;
+		s->sh_size = sh->size;
+	} else {
+		Elf32_Shdr *s = (Elf32_Shdr *) p;
+
+		s->sh_name = sh->name;
+		s->sh_offset = sh->offset;
+		s->sh_size = sh->size;
+	}
+}
+
+static uint32_t
+elf_symname(const struct elf *elf, const struct shdr *sh, size_t i)
+{
+	const unsigned char *p = elf->base + sh->offset + i * sh->entsize;
+
+	if (elf->class == ELFCLASS64)
+		return ((const Elf64_Sym *) p)->st_name;
+	else
+		return ((const Elf32_Sym *) p)->st_name;
+}
+
+static int
+elf_symtype(const struct elf *elf, const struct shdr *sh, size_t i)
+{
+	const unsigned char *p = elf->base + sh->offset + i * sh->entsize;
+
+	if (elf->class == ELFCLASS64)
+		return ELF64_ST_TYPE(((const Elf64_Sym *) p)->st_info);
+	else
+		return ELF32_ST_TYPE(((const Elf32_Sym *) p)->st_info);
+}
+
+static void
+elf_setsymname(const struct elf *elf, unsigned char *p, uint32_t name)
+{
+	if (elf->class == ELFCLASS64)
+		((Elf64_Sym *) p)->st_name = name;
+	else
+		((Elf32_Sym *) p)->st_name = name;
+}
+
+/*
+ * Collect the names of all symbols in the first section of the given type,
+ * in symbol table order. Returns the section index, or 0 if there is none.
+ */
+
+static size_t
+elf_symbols(const struct elf *elf, uint32_t type, const char ***names,
+    size_t *n)
+{
+	struct shdr sh, strsh;
+	const char *strtab;
+	size_t i, nsyms;
+
+	for (i = 1; i < elf->shnum; i++) {
+		elf_shdr(elf, i, &sh);
+		if (sh.type == type)
+			break;
+	}
+	if (i >= elf->shnum)
+		return 0;
+
+	if (sh.entsize < (elf->class == ELFCLASS64 ? sizeof(Elf64_Sym) :
+	    sizeof(Elf32_Sym)) || sh.link == 0 || sh.link >= elf->shnum)
+		errx(1, "%s: bad symbol table", elf->path);
+	elf_shdr(elf, sh.link, &strsh);
+	if (strsh.type != SHT_STRTAB || strsh.size == 0 ||
+	    elf->base[strsh.offset + strsh.size - 1] != '\0')
+		errx(1, "%s: bad string table", elf->path);
+	strtab = (const char *) elf->base + strsh.offset;
+
+	nsyms = sh.size / sh.entsize;
+	*names = reallocarray(NULL, nsyms, sizeof(**names));
+	if (*names == NULL)
+		err(1, "reallocarray");
+
+	for (*n = 0; *n < nsyms; (*n)++) {
+		uint32_t name = elf_symname(elf, &sh, *n);
+
+		if (name >= strsh.size)
+			errx(1, "%s: bad symbol name", elf->path);
+		(*names)[*n] = strtab + name;
+	}
+
+	return i;
+}
+
+/*
+ * Batch conversion: names are split into chunks, which worker threads
+ * claim one at a time. Each chunk's results are stored NUL-terminated in
+ * its own arena, so nothing needs to be shared between threads but the
+ * index of the next chunk.
+ */
+
+#define CHUNK	4096
+
+struct chunk {
+	char		*arena;
+	size_t		 len;
+	size_t		 cap;
+	size_t		*off;		/* result offsets, per name */
+};
+
+struct batch {
+	convfn		 fn;
+	int		 check;		/* only keep decoded names that re-encode */
+	const char *const *names;
+	size_t		 n;
+	struct chunk	*chunks;
+	size_t		 nchunks;
+	size_t		 next;
+};
+
+static void
+reserve(struct chunk *c, size_t len)
+{
+	void *new;
+
+	if (c->len + len <= c->cap)
+		return;
+
+	while (c->len + len > c->cap)
+		c->cap = c->cap == 0 ? 65536 : c->cap * 2;
+	if ((new = realloc(c->arena, c->cap)) == NULL)
+		err(1, "realloc");
+	c->arena = new;
+}
+
+/*
+ * Decoding and checking the result use per-thread buffers that are only
+ * ever grown, so nothing is allocated per name once they are large enough.
+ */
+
+static __thread void *ws;
+static __thread size_t wscap;
+
+static void *
+grow(void *buf, size_t *cap, size_t need)
+{
+	if (need <= *cap)
+		return buf;
+
+	if ((buf = realloc(buf, need)) == NULL)
+		err(1, "realloc");
+	*cap = need;
+
+	return buf;
+}
+
+static size_t
+decode_ws(char *name, size_t namelen, const char *enc, size_t enclen)
+{
+	if (!funvalid(enc, enclen))
+		return FUNYCODE_ERR;
+
+	ws = grow(ws, &wscap, FUNYCODE_WSLEN(enclen));
+
+	return fundecode_ws(name, namelen, enc, enclen, ws, wscap);
+}
+
+/*
+ * Check that a decoded name encodes back into the original, so plain C
+ * names that happen to look like funycode are kept as they are.
+ */
+
+static int
+roundtrip(const char *enc, size_t enclen, const char *name, size_t namelen)
+{
+	static __thread wchar_t *wname;
+	static __thread char *back;
+	static __thread size_t wnamecap, backcap;
+	mbstate_t mbs = { 0 };
+	const char *src = name;
+	size_t wlen;
+
+	/* a name has no more characters than bytes */
+	wname = grow(wname, &wnamecap, namelen * sizeof(wchar_t));
+	wlen = mbsnrtowcs(wname, &src, namelen, namelen, &mbs);
+	if (wlen == (size_t) -1)
+		return 0;
+
+	ws = grow(ws, &wscap, FUNYCODE_ENC_WSLEN(wlen));
+	back = grow(back, &backcap, enclen + 1);
+
+	return wfunencode_ws(back, backcap, wname, wlen, ws, wscap) ==
+	    enclen && memcmp(back, enc, enclen) == 0;
+}
+
+static void
+convert(const struct batch *b, struct chunk *c, const char *name)
+{
+	size_t namelen, len, cap;
+
+	namelen = strlen(name);
+	while (1) {
+		cap = c->cap - c->len;
+		len = b->fn(c->arena + c->len, cap, name, namelen);
+		if (len == FUNYCODE_ERR || len < cap)
+			break;
+		reserve(c, len + 1);
+	}
+
+	if (len != FUNYCODE_ERR && b->check &&
+	    !roundtrip(name, namelen, c->arena + c->len, len))
+		len = FUNYCODE_ERR;
+
+	if (len == FUNYCODE_ERR) {
+		reserve(c, namelen + 1);
+		memcpy(c->arena + c->len, name, namelen + 1);
+		len = namelen;
+	}
+
+	c->len += len + 1;
+}
+
+static void *
+worker(void *arg)
+{
+	struct batch *b = arg;
+	size_t i, j, end;
+
+	while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) <
+	    b->nchunks) {
+		struct chunk *c = &b->chunks[i];
+
+		end = (i + 1) * CHUNK < b->n ? (i + 1) * CHUNK : b->n;
+		c->off = reallocarray(NULL, end - i * CHUNK, sizeof(*c->off));
+		if (c->off == NULL)
+			err(1, "reallocarray");
+
+		for (j = i * CHUNK; j < end; j++) {
+			c->off[j - i * CHUNK] = c->len;
+			convert(b, c, b->names[j]);
+		}
+	}
+
+	return NULL;
+}
+
+static void
+batch_run(struct batch *b, int nthreads)
+{
+	pthread_t *threads;
+	int i, error;
+
+	b->nchunks = (b->n + CHUNK - 1) / CHUNK;
+	b->chunks = calloc(b->nchunks, sizeof(*b->chunks));
+	if (b->chunks == NULL && b->nchunks != 0)
+		err(1, "calloc");
+	b->next = 0;
+
+	if ((size_t) nthreads > b->nchunks)
+		nthreads = b->nchunks > 0 ? b->nchunks : 1;
+
+	threads = calloc(nthreads, sizeof(*threads));
+	if (threads == NULL)
+		err(1, "calloc");
+
+	for (i = 1; i < nthreads; i++)
+		if ((error = pthread_create(&threads[i], NULL, worker, b)) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	worker(b);
+	for (i = 1; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+
+	free(threads);
+}
+
+static const char *
+batch_result(const struct batch *b, size_t i)
+{
+	const struct chunk *c = &b->chunks[i / CHUNK];
+
+	return c->arena + c->off[i % CHUNK];
+}
+
+static void
+batch_free(struct batch *b)
+{
+	size_t i;
+
+	for (i = 0; i < b->nchunks; i++) {
+		free(b->chunks[i].arena);
+		free(b->chunks[i].off);
+	}
+	free(b->chunks);
+}
+
+static void
+decode(const char *path, int dynamic, int nthreads)
+{
+	struct elf elf;
+	struct batch b = { 0 };
+	const char **names = NULL;
+	const char *name;
+	size_t i;
+
+	elf_open(&elf, path);
+	if (elf_symbols(&elf, dynamic ? SHT_DYNSYM : SHT_SYMTAB, &names,
+	    &b.n) == 0 &&
+	    (dynamic || elf_symbols(&elf, SHT_DYNSYM, &names, &b.n) == 0)) {
+		warnx("%s: no symbols", path);
+		munmap(elf.base, elf.size);
+		return;
+	}
+
+	b.fn = decode_ws;
+	b.check = 1;
+	b.names = names;
+	batch_run(&b, nthreads);
+
+	/* symbol 0 is always the null symbol */
+	for (i = 1; i < b.n; i++)
+		if (*(name = batch_result(&b, i)) != '\0')
+			puts(name);
+
+	batch_free(&b);
+	free(names);
+	munmap(elf.base, elf.size);
+}
+
+/*
+ * String table construction. Sorting the names by their reversal, in
+ * descending order, puts every name right after the names it is a suffix
+ * of, so duplicates are stored once and suffixes point into the name
+ * they end.
+ */
+
+struct str {
+	const char	*s;
+	size_t		 len;
+	uint32_t	 off;
+};
+
+static int
+revcmp(const void *a, const void *b)
+{
+	const struct str *x = *(struct str *const *) a;
+	const struct str *y = *(struct str *const *) b;
+	size_t i;
+
+	for (i = 1; i <= x->len && i <= y->len; i++) {
+		unsigned char cx = x->s[x->len - i], cy = y->s[y->len - i];
+
+		if (cx != cy)
+			return cx < cy ? 1 : -1;
+	}
+
+	return x->len < y->len ? 1 : x->len > y->len ? -1 : 0;
+}
+
+static char *
+strtab_build(struct str *strs, size_t n, size_t *tablen)
+{
+	struct str **sorted, *owner = NULL;
+	char *tab;
+	size_t i, len;
+
+	sorted = reallocarray(NULL, n, sizeof(*sorted));
+	if (sorted == NULL)
+		err(1, "reallocarray");
+	for (i = 0; i < n; i++)
+		sorted[i] = &strs[i];
+	qsort(sorted, n, sizeof(*sorted), revcmp);
+
+	for (i = 0, len = 1; i < n; i++)
+		len += sorted[i]->len + 1;
+	if ((tab = malloc(len)) == NULL)
+		err(1, "malloc");
+
+	tab[0] = '\0';
+	for (i = 0, len = 1; i < n; i++) {
+		struct str *s = sorted[i];
+
+		if (s->len == 0) {
+			s->off = 0;
+		} else if (owner != NULL && owner->len >= s->len &&
+		    memcmp(owner->s + owner->len - s->len, s->s,
+		    s->len) == 0) {
+			s->off = owner->off + owner->len - s->len;
+		} else {
+			if (len > UINT32_MAX - s->len - 1)
+				errx(1, "string table too large");
+			memcpy(tab + len, s->s, s->len + 1);
+			s->off = len;
+			len += s->len + 1;
+			owner = s;
+		}
+	}
+
+	free(sorted);
+	*tablen = len;
+
+	return tab;
+}
+
+static int
+hasnonascii(const char *s)
+{
+	for (; *s != '\0'; s++)
+		if ((unsigned char) *s >= 0x80)
+			return 1;
+
+	return 0;
+}
+
+static size_t
+align(size_t pos, size_t a)
+{
+	return a > 1 ? (pos + a - 1) / a * a : pos;
+}
+
+static int
+offcmp(const void *a, const void *b)
+{
+	const struct shdr *x = *(struct shdr *const *) a;
+	const struct shdr *y = *(struct shdr *const *) b;
+
+	return x->offset < y->offset ? -1 : x->offset > y->offset;
+}
+
+/*
+ * Rewrite a relocatable object, encoding all symbol names that contain
+ * non-ASCII characters. The symbol string table is rebuilt from scratch
+ * and all sections are laid out again in their original order.
+ */
+
+static void
+encode(const char *in, const char *out, int nthreads)
+{
+	struct elf elf;
+	struct batch b = { 0 };
+	struct shdr *sh, **order, symsh;
+	struct str *strs;
+	const char **names = NULL, **encnames;
+	unsigned char *obuf, *shtab;
+	char *strtab;
+	size_t i, j, symndx, strndx, nsyms, nstrs, strtablen, pos, olen;
+	size_t *from;
+	int fd, shared;
+
+	elf_open(&elf, in);
+	if (elf.type != ET_REL)
+		errx(1, "%s: not a relocatable object", in);
+
+	symndx = elf_symbols(&elf, SHT_SYMTAB, &names, &nsyms);
+	if (symndx == 0)
+		errx(1, "%s: no symbol table", in);
+
+	sh = reallocarray(NULL, elf.shnum, sizeof(*sh));
+	order = reallocarray(NULL, elf.shnum, sizeof(*order));
+	from = reallocarray(NULL, elf.shnum, sizeof(*from));
+	if (sh == NULL || order == NULL || from == NULL)
+		err(1, "reallocarray");
+	for (i = 0; i < elf.shnum; i++)
+		elf_shdr(&elf, i, &sh[i]);
+	symsh = sh[symndx];
+	strndx = symsh.link;
+
+	/* some toolchains put section names in the symbol string table */
+	shared = elf.shstrndx == strndx;
+
+	/*
+	 * Encode the names that need it, in parallel.
+	 */
+
+	encnames = reallocarray(NULL, nsyms, sizeof(*encnames));
+	if (encnames == NULL)
+		err(1, "reallocarray");
+	for (i = 1; i < nsyms; i++) {
+		int type = elf_symtype(&elf, &symsh, i);
+
+		if (type != STT_FILE && type != STT_SECTION &&
+		    hasnonascii(names[i]))
+			encnames[b.n++] = names[i];
+	}
+
+	b.fn = funencode;
+	b.names = encnames;
+	batch_run(&b, nthreads);
+
+	nstrs = nsyms + (shared ? elf.shnum : 0);
+	strs = reallocarray(NULL, nstrs, sizeof(*strs));
+	if (strs == NULL)
+		err(1, "reallocarray");
+	for (i = 0, j = 0; i < nsyms; i++) {
+		strs[i].s = names[i];
+		if (i > 0 && j < b.n && encnames[j] == names[i]) {
+			strs[i].s = batch_result(&b, j++);
+			if (strcmp(strs[i].s, names[i]) == 0)
+				errx(1, "%s: cannot encode '%s'", in,
+				    names[i]);
+		}
+		strs[i].len = strlen(strs[i].s);
+	}
+	for (i = 0; shared && i < elf.shnum; i++) {
+		if (sh[i].name >= sh[strndx].size)
+			errx(1, "%s: bad section name", in);
+		strs[nsyms + i].s = (const char *) elf.base +
+		    sh[strndx].offset + sh[i].name;
+		strs[nsyms + i].len = strlen(strs[nsyms + i].s);
+	}
+
+	strtab = strtab_build(strs, nstrs, &strtablen);
+
+	/*
+	 * Lay out the sections again, in their original order.
+	 */
+
+	for (i = 0; i + 1 < elf.shnum; i++)
+		order[i] = &sh[i + 1];
+	qsort(order, elf.shnum - 1, sizeof(*order), offcmp);
+
+	for (i = 0; i < elf.shnum; i++)
+		from[i] = sh[i].offset;
+
+	sh[strndx].size = strtablen;
+	for (i = 0, pos = elf.ehsize; i + 1 < elf.shnum; i++) {
+		struct shdr *s = order[i];
+
+		pos = align(pos, s->addralign);
+		s->offset = pos;
+		if (s->type != SHT_NOBITS)
+			pos += s->size;
+	}
+	pos = align(pos, 8);
+	olen = pos + elf.shnum * elf.shentsize;
+
+	if ((obuf = calloc(1, olen)) == NULL)
+		err(1, "calloc");
+	memcpy(obuf, elf.base, elf.ehsize);
+	for (i = 1; i < elf.shnum; i++) {
+		if (sh[i].type == SHT_NOBITS)
+			continue;
+		if (i == strndx)
+			memcpy(obuf + sh[i].offset, strtab, strtablen);
+		else
+			memcpy(obuf + sh[i].offset, elf.base + from[i],
+			    sh[i].size);
+	}
+
+	for (i = 1; i < nsyms; i++)
+		elf_setsymname(&elf, obuf + sh[symndx].offset +
+		    i * symsh.entsize, strs[i].off);
+
+	shtab = obuf + pos;
+	memcpy(shtab, elf.base + elf.shoff, elf.shnum * elf.shentsize);
+	for (i = 0; i < elf.shnum; i++) {
+		if (shared)
+			sh[i].name = strs[nsyms + i].off;
+		elf_setshdr(&elf, shtab + i * elf.shentsize, &sh[i]);
+	}
+
+	if (elf.class == ELFCLASS64)
+		((Elf64_Ehdr *) obuf)->e_shoff = pos;
+	else
+		((Elf32_Ehdr *) obuf)->e_shoff = pos;
+
+	if ((fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+		err(1, "%s", out);
+	for (i = 0; i < olen; ) {
+		ssize_t n = write(fd, obuf + i, olen - i);
+
+		if (n < 0)
+			err(1, "%s", out);
+		i += n;
+	}
+	if (close(fd) < 0)
+		err(1, "%s", out);
+
+	batch_free(&b);
+	free(obuf);
+	free(strtab);
+	free(strs);
+	free(encnames);
+	free(names);
+	free(from);
+	free(order);
+	free(sh);
+	munmap(elf.base, elf.size);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: funyelf [-D] [-j threads] file ...\n"
+	    "       funyelf -e [-j threads] in.o out.o\n");
+	exit(1);
+}
+
+int
+main(int argc, char *const *argv)
+{
+	int ch, dflag, eflag, nthreads;
+	long n;
+
+	setlocale(LC_CTYPE, "");
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = n > 0 ? n : 1;
+
+	dflag = eflag = 0;
+	while ((ch = getopt(argc, argv, "Dej:")) != -1) {
+		switch (ch) {
+		case 'D':
+			dflag = 1;
+			break;
+
+		case 'e':
+			eflag = 1;
+			break;
+
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				usage();
+			break;
+
+		case '?':
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (eflag) {
+		if (argc != 2 || dflag)
+			usage();
+		encode(argv[0], argv[1], nthreads);
+		return 0;
+	}
+
+	if (argc == 0)
+		usage();
+
+	for (; argc > 0; argc--, argv++)
+		decode(*argv, dflag, nthreads);
+
+	return 0;
+}
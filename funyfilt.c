@@ -15,73 +15,986 @@
  */
 
 #include "funycode.h"
+#include "cache.h"
+#include "demangle.h"
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 
 #include <stdio.h>
 #include <stdint.h>
 #include <locale.h>
 #include <unistd.h>
 #include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+/*
+ * Run the encoder or decoder, growing the result buffer as needed.
+ */
+
+static size_t
+convert(convfn fn, char **buf, size_t *cap, const char *src, size_t srclen)
+{
+	size_t len, newcap;
+	void *new;
+
+	while ((len = fn(*buf, *cap, src, srclen)) != FUNYCODE_ERR &&
+	    len >= *cap) {
+		newcap = *cap == 0 ? 64 : (*cap * 2);
+		if (newcap > UINT16_MAX) {
+			errno = EOVERFLOW;
+			return FUNYCODE_ERR;
+		}
+
+		new = realloc(*buf, newcap);
+		if (new == NULL)
+			err(1, "realloc");
+
+		*buf = new;
+		*cap = newcap;
+	}
+
+	return len;
+}
+
+/*
+ * Encode, capping the result at maxlen characters if it's set.
+ */
+
+static size_t maxlen;
+
+static size_t
+encode(char *enc, size_t enclen, const char *name, size_t namelen)
+{
+	if (maxlen == 0)
+		return funencode(enc, enclen, name, namelen);
+
+	return funencode_max(enc, enclen, name, namelen, maxlen, NULL, NULL);
+}
+
+/*
+ * Identifier characters, those that can start an encoded name, and those
+ * that can appear in (or start) an unquoted assembler symbol.
+ */
+
+#define ID	1
+#define ENC	2
+#define SYM	4
+#define SYMSTART 8
+
+static const unsigned char ctab[256] = {
+	['0' ... '9'] = ID | SYM,
+	['A' ... 'Z'] = ID | ENC | SYM | SYMSTART,
+	['a' ... 'z'] = ID | ENC | SYM | SYMSTART,
+	['_'] = ID | SYM | SYMSTART,
+	['.'] = SYM | SYMSTART,
+	['$'] = SYM,
+	[0x80 ... 0xff] = SYM | SYMSTART,
+};
+
+/*
+ * Make sure a buffer that is only ever grown holds at least need bytes.
+ */
+
+static void *
+reserve(void *buf, size_t *cap, size_t need)
+{
+	if (need <= *cap)
+		return buf;
+
+	if ((buf = realloc(buf, need)) == NULL)
+		err(1, "realloc");
+	*cap = need;
+
+	return buf;
+}
+
+/*
+ * Check whether an identifier looks like funycode: it must have exactly one
+ * underscore and can't start with an underscore, or with a digit unless
+ * the underscore ends it. Those that do are decoded, and only replaced if
+ * encoding the result gives the same identifier back. Both directions use
+ * workspace kept between calls, so nothing is allocated per identifier
+ * once the buffers are large enough.
+ *
+ * Candidates are found by memchr() on the underscore every name with a
+ * suffix contains, which the C library does a word or vector at a time;
+ * the character table is only consulted around each underscore found.
+ */
+
+static void
+scan(const char *line, size_t linelen)
+{
+	static char *name, *enc;
+	static wchar_t *wname;
+	static void *ws;
+	static size_t namecap, enccap, wnamecap, wscap;
+	mbstate_t mbs = { 0 };
+	const char *p, *end, *out, *u, *s, *e, *src;
+	size_t len, namelen, wlen;
+
+	p = out = line;
+	end = line + linelen;
+	while ((u = memchr(p, '_', end - p)) != NULL) {
+		for (s = u; s > p && (ctab[(unsigned char) s[-1]] & ID); s--)
+			if (s[-1] == '_')
+				break;
+		for (e = u + 1; e < end && (ctab[(unsigned char) *e] & ID); e++)
+			if (*e == '_')
+				break;
+
+		if (s > p && s[-1] == '_') {
+			/* more than one underscore: skip the identifier */
+			while (e < end && (ctab[(unsigned char) *e] & ID))
+				e++;
+			p = e;
+			continue;
+		}
+		if (e < end && *e == '_') {
+			while (e < end && (ctab[(unsigned char) *e] & ID))
+				e++;
+			p = e;
+			continue;
+		}
+
+		p = e;
+		len = e - s;
+		if (!(ctab[(unsigned char) *s] & ENC) &&
+		    !(*s >= '0' && *s <= '9' && e == u + 1))
+			continue;
+		if (!funvalid(s, len))
+			continue;
+
+		ws = reserve(ws, &wscap, FUNYCODE_WSLEN(len));
+		while ((namelen = fundecode_ws(name, namecap, s, len, ws,
+		    wscap)) != FUNYCODE_ERR && namelen >= namecap)
+			name = reserve(name, &namecap, namelen + 1);
+		if (namelen == FUNYCODE_ERR)
+			continue;
+
+		/* a name has no more characters than bytes */
+		wname = reserve(wname, &wnamecap, namelen * sizeof(wchar_t));
+		src = name;
+		memset(&mbs, 0, sizeof(mbs));
+		wlen = mbsnrtowcs(wname, &src, namelen, namelen, &mbs);
+		if (wlen == (size_t) -1)
+			continue;
+
+		ws = reserve(ws, &wscap, FUNYCODE_ENC_WSLEN(wlen));
+		enc = reserve(enc, &enccap, len + 1);
+		if (wfunencode_ws(enc, enccap, wname, wlen, ws, wscap) != len ||
+		    memcmp(enc, s, len) != 0)
+			continue;
+
+		fwrite(out, 1, s - out, stdout);
+		fwrite(name, 1, namelen, stdout);
+		out = e;
+	}
+
+	fwrite(out, 1, end - out, stdout);
+	putchar('\n');
+}
+
+/*
+ * Directives whose operands are strings or section names rather than
+ * symbols; these lines are passed through untouched.
+ */
+
+static const char *const asmdata[] = {
+	".abort", ".ascii", ".asciz", ".err", ".error", ".file", ".ident",
+	".incbin", ".include", ".print", ".pushsection", ".section",
+	".stabs", ".string", ".string16", ".string32", ".string64",
+	".string8", ".warning",
+};
+
+static int
+isasmdata(const char *s, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(asmdata) / sizeof(asmdata[0]); i++)
+		if (strlen(asmdata[i]) == len && memcmp(asmdata[i], s, len) == 0)
+			return 1;
+
+	return 0;
+}
+
+/*
+ * Rewrite the symbols in a line of GNU assembler source. Names made up of
+ * identifier characters, '.' and '$' are how the compiler spells ordinary
+ * and local symbols and are left alone; anything else, whether quoted or
+ * an unquoted name with UTF-8 in it, is replaced by its encoded form. The
+ * same name always gets the same spelling, so definitions and references
+ * keep matching. Comments, character constants and string operands are
+ * skipped.
+ */
+
+/*
+ * Write an encoded symbol, in quotes if it can't go without: an encoding
+ * made up of only the suffix can start with a digit.
+ */
+
+static void
+putsym(const char *enc, size_t enclen)
+{
+	size_t i;
+
+	for (i = 0; i < enclen; i++)
+		if (!(ctab[(unsigned char) enc[i]] & (i == 0 ? SYMSTART : SYM)) ||
+		    (enc[i] & 0x80))
+			break;
+
+	if (i == enclen && enclen > 0)
+		fwrite(enc, 1, enclen, stdout);
+	else
+		printf("\"%.*s\"", (int) enclen, enc);
+}
+
+static void
+asmline(struct cache *c, const char *line, size_t linelen)
+{
+	static int incomment;
+	const char *p, *end, *out, *s, *e, *enc;
+	size_t enclen;
+	int first, skip, plain, esc;
+
+	p = out = line;
+	end = line + linelen;
+	first = 1;
+	skip = 0;
+	while (p < end) {
+		if (incomment) {
+			for (; p + 1 < end; p++)
+				if (p[0] == '*' && p[1] == '/')
+					break;
+			if (p + 1 >= end)
+				break;
+			incomment = 0;
+			p += 2;
+			continue;
+		}
+
+		switch (*p) {
+		case '/':
+			if (p + 1 < end && p[1] == '*') {
+				incomment = 1;
+				p += 2;
+				continue;
+			} else if (p + 1 < end && p[1] == '/')
+				goto done;
+			break;
+
+		case '#':
+			goto done;
+
+		case ';':
+			first = 1;
+			skip = 0;
+			p++;
+			continue;
+
+		case ':':
+			first = 1;
+			p++;
+			continue;
+
+		case ' ':
+		case '\t':
+			p++;
+			continue;
+
+		case '\'':
+			if (p + 1 < end && p[1] == '\\')
+				p++;
+			p = p + 2 < end ? p + 2 : end;
+			first = 0;
+			continue;
+
+		case '"':
+			s = ++p;
+			plain = 1;
+			esc = 0;
+			for (; p < end && *p != '"'; p++) {
+				if (*p == '\\') {
+					/* escapes: leave the name alone */
+					esc = 1;
+					if (p + 1 < end)
+						p++;
+				} else if (!(ctab[(unsigned char) *p] & SYM) ||
+				    (*p & 0x80))
+					plain = 0;
+			}
+			e = p;
+			if (p < end)
+				p++;
+			first = 0;
+			if (skip || esc || plain || e == s || e == end)
+				continue;
+			if ((enc = cache_conv(c, s, e - s, &enclen)) == NULL)
+				continue;
+			fwrite(out, 1, s - 1 - out, stdout);
+			putsym(enc, enclen);
+			out = p;
+			continue;
+		}
+
+		if (!(ctab[(unsigned char) *p] & SYMSTART)) {
+			/* numbers, local labels like "1f", operators */
+			if (*p >= '0' && *p <= '9')
+				while (p < end && (ctab[(unsigned char) *p] & SYM))
+					p++;
+			else
+				p++;
+			first = 0;
+			continue;
+		}
+
+		s = p;
+		plain = 1;
+		for (; p < end && (ctab[(unsigned char) *p] & SYM); p++)
+			if (*p & 0x80)
+				plain = 0;
+		e = p;
+
+		if (first && *s == '.' && isasmdata(s, e - s))
+			skip = 1;
+		first = 0;
+		if (skip || plain)
+			continue;
+		if ((enc = cache_conv(c, s, e - s, &enclen)) == NULL)
+			continue;
+		fwrite(out, 1, s - out, stdout);
+		putsym(enc, enclen);
+		out = e;
+	}
+
+done:
+	fwrite(out, 1, end - out, stdout);
+	putchar('\n');
+}
+
+/*
+ * Demangle an Itanium C++ ABI name and encode the result; names that
+ * aren't mangled are encoded as they are. The demangled name is kept
+ * around, as the cache calls this again if the buffer was too small. The
+ * buffers are static, so this is only for the filter, which runs on the
+ * main thread alone.
+ */
+
+static size_t
+demangle(char *buf, size_t buflen, const char *src, size_t srclen)
+{
+	static char *mangled, *name;
+	static size_t mangledcap, namecap, namelen;
+	char *new;
+	int status;
+
+	if (mangled != NULL && strlen(mangled) == srclen &&
+	    memcmp(mangled, src, srclen) == 0)
+		goto encode;
+
+	if (srclen >= mangledcap) {
+		mangledcap = srclen + 1;
+		if ((mangled = realloc(mangled, mangledcap)) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(mangled, src, srclen);
+	mangled[srclen] = '\0';
+
+	new = demangle_abi(mangled, name, &namecap, &status);
+	switch (status) {
+	case 0:
+		name = new;
+		namelen = strlen(name);
+		break;
+
+	case -1:
+		errx(1, "__cxa_demangle: out of memory");
+
+	default:
+		/* not a mangled name */
+		if (srclen >= namecap) {
+			namecap = srclen + 1;
+			if ((name = realloc(name, namecap)) == NULL)
+				err(1, "realloc");
+		}
+		memcpy(name, mangled, srclen + 1);
+		namelen = srclen;
+		break;
+	}
+
+encode:
+	return encode(buf, buflen, name, namelen);
+}
+
+/*
+ * Daemon mode. Requests and responses are frames of one byte, a 32-bit
+ * big-endian length and that many bytes of payload. A request's first
+ * byte is 'e' to encode or 'd' to decode the payload; a response's is 0
+ * followed by the result, or an errno value with an empty payload.
+ * Clients may send any number of requests over a connection. Every
+ * worker thread accepts connections and serves all of its own with
+ * poll(), so idle clients don't hold up anyone else. The workers share a
+ * cache of limited size for each direction, and names are subject to
+ * work limits, as clients can't be trusted to send reasonable input.
+ */
+
+#define MAXFRAME	UINT16_MAX
+#define HDRLEN		5
+
+#define MAXCONN		256		/* connections per worker */
+#define MAXPENDING	(4 * (HDRLEN + MAXFRAME)) /* unsent output per client */
+#define CACHEMAX	(64 * 1024 * 1024) /* bytes per cache */
+#define DAEMON_LEN	4096		/* name characters */
+#define DAEMON_CHARS	512		/* distinct encoded characters */
+
+struct daemon {
+	int		 sock;
+	struct cache	*enc;
+	struct cache	*dec;
+};
+
+struct conn {
+	int		 fd;
+	unsigned char	*in;		/* frames received */
+	size_t		 inlen;
+	size_t		 incap;
+	unsigned char	*out;		/* frames to send */
+	size_t		 outpos;
+	size_t		 outlen;
+	size_t		 outcap;
+};
+
+static int
+readall(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = read(fd, p, len)) < 0 && errno == EINTR)
+			continue;
+		else if (n <= 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+writeall(int fd, const void *buf, size_t len)
+{
+	const char *p = buf;
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = write(fd, p, len)) < 0 && errno == EINTR)
+			continue;
+		else if (n < 0)
+			return -1;
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int
+sendframe(int fd, unsigned char op, const char *buf, size_t len)
+{
+	unsigned char hdr[5];
+
+	hdr[0] = op;
+	hdr[1] = len >> 24;
+	hdr[2] = len >> 16;
+	hdr[3] = len >> 8;
+	hdr[4] = len;
+
+	if (writeall(fd, hdr, sizeof(hdr)) < 0 || writeall(fd, buf, len) < 0)
+		return -1;
+
+	return 0;
+}
+
+static int
+recvframe(int fd, unsigned char *op, char *buf, size_t *len)
+{
+	unsigned char hdr[5];
+
+	if (readall(fd, hdr, sizeof(hdr)) < 0)
+		return -1;
+
+	*op = hdr[0];
+	*len = (size_t) hdr[1] << 24 | hdr[2] << 16 | hdr[3] << 8 | hdr[4];
+	if (*len > MAXFRAME) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return readall(fd, buf, *len);
+}
+
+static void
+putframe(struct conn *cn, unsigned char op, const char *buf, size_t len)
+{
+	unsigned char *p;
+
+	if (cn->outlen + HDRLEN + len > cn->outcap) {
+		cn->outcap = cn->outlen + HDRLEN + len;
+		if (cn->outcap < 2 * (HDRLEN + MAXFRAME))
+			cn->outcap = 2 * (HDRLEN + MAXFRAME);
+		if ((cn->out = realloc(cn->out, cn->outcap)) == NULL)
+			err(1, "realloc");
+	}
+
+	p = cn->out + cn->outlen;
+	p[0] = op;
+	p[1] = len >> 24;
+	p[2] = len >> 16;
+	p[3] = len >> 8;
+	p[4] = len;
+	memcpy(p + HDRLEN, buf, len);
+	cn->outlen += HDRLEN + len;
+}
+
+/*
+ * Answer all complete requests received so far; fails if one is too large.
+ */
+
+static int
+requests(struct daemon *d, struct conn *cn)
+{
+	const unsigned char *p;
+	const char *res;
+	size_t off, len, reslen;
+
+	for (off = 0; cn->inlen - off >= HDRLEN; off += HDRLEN + len) {
+		p = cn->in + off;
+		len = (size_t) p[1] << 24 | p[2] << 16 | p[3] << 8 | p[4];
+		if (len > MAXFRAME)
+			return -1;
+		if (cn->inlen - off < HDRLEN + len)
+			break;
+
+		if (p[0] == 'e')
+			res = cache_conv(d->enc, (const char *) p + HDRLEN, len,
+			    &reslen);
+		else if (p[0] == 'd')
+			res = cache_conv(d->dec, (const char *) p + HDRLEN, len,
+			    &reslen);
+		else {
+			res = NULL;
+			errno = EINVAL;
+		}
+
+		if (res == NULL)
+			putframe(cn, errno != 0 ? errno : EINVAL, NULL, 0);
+		else
+			putframe(cn, 0, res, reslen);
+	}
+
+	memmove(cn->in, cn->in + off, cn->inlen - off);
+	cn->inlen -= off;
+
+	return 0;
+}
+
+/*
+ * Read and answer what a client sent, and send what can be sent without
+ * blocking. Returns -1 when the connection is to be closed.
+ */
+
+static int
+connio(struct daemon *d, struct conn *cn, short revents)
+{
+	ssize_t n;
+
+	if (revents & (POLLERR | POLLNVAL))
+		return -1;
+
+	if (revents & (POLLIN | POLLHUP)) {
+		if (cn->inlen == cn->incap) {
+			cn->incap = cn->incap == 0 ? 4096 : cn->incap * 2;
+			if (cn->incap > HDRLEN + MAXFRAME)
+				cn->incap = HDRLEN + MAXFRAME;
+			if ((cn->in = realloc(cn->in, cn->incap)) == NULL)
+				err(1, "realloc");
+		}
+
+		n = read(cn->fd, cn->in + cn->inlen, cn->incap - cn->inlen);
+		if (n == 0)
+			return -1;
+		else if (n < 0 && errno != EAGAIN && errno != EINTR)
+			return -1;
+		else if (n > 0) {
+			cn->inlen += n;
+			if (requests(d, cn) < 0)
+				return -1;
+		}
+	}
+
+	while (cn->outpos < cn->outlen) {
+		n = write(cn->fd, cn->out + cn->outpos, cn->outlen - cn->outpos);
+		if (n < 0 && (errno == EAGAIN || errno == EINTR))
+			break;
+		else if (n < 0)
+			return -1;
+		cn->outpos += n;
+	}
+	if (cn->outpos == cn->outlen)
+		cn->outpos = cn->outlen = 0;
+
+	return 0;
+}
+
+static void *
+serve(void *arg)
+{
+	struct daemon *d = arg;
+	struct pollfd pfd[1 + MAXCONN];
+	struct conn conns[MAXCONN], *cn;
+	size_t i, nconn = 0;
+	int fd;
+
+	for (;;) {
+		/* stop accepting when full, and reading when behind */
+		pfd[0].fd = nconn < MAXCONN ? d->sock : -1;
+		pfd[0].events = POLLIN;
+		for (i = 0; i < nconn; i++) {
+			cn = &conns[i];
+			pfd[1 + i].fd = cn->fd;
+			pfd[1 + i].events = 0;
+			if (cn->outlen - cn->outpos <= MAXPENDING)
+				pfd[1 + i].events |= POLLIN;
+			if (cn->outpos < cn->outlen)
+				pfd[1 + i].events |= POLLOUT;
+		}
+
+		if (poll(pfd, 1 + nconn, -1) < 0) {
+			if (errno != EINTR)
+				err(1, "poll");
+			continue;
+		}
+
+		/* last to first, so closing one only moves those done */
+		for (i = nconn; i-- > 0;) {
+			if (pfd[1 + i].revents == 0 ||
+			    connio(d, &conns[i], pfd[1 + i].revents) == 0)
+				continue;
+
+			close(conns[i].fd);
+			free(conns[i].in);
+			free(conns[i].out);
+			conns[i] = conns[--nconn];
+		}
+
+		if (!(pfd[0].revents & POLLIN))
+			continue;
+
+		/* the other workers may have beaten us to it */
+		if ((fd = accept(d->sock, NULL, NULL)) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR && errno != ECONNABORTED)
+				warn("accept");
+		} else if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0) {
+			warn("fcntl");
+			close(fd);
+		} else {
+			memset(&conns[nconn], 0, sizeof(conns[nconn]));
+			conns[nconn++].fd = fd;
+		}
+	}
+
+	return NULL;
+}
+
+static int
+sockopen(const char *path, struct sockaddr_un *sun)
+{
+	int s;
+
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun->sun_path))
+		errx(1, "%s: path too long", path);
+	strcpy(sun->sun_path, path);
+
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+
+	return s;
+}
+
+static void
+daemonrun(const char *path, int nthreads)
+{
+	struct sockaddr_un sun;
+	struct daemon d;
+	pthread_t thread;
+	int i, s, error;
+
+	/* refuse to take over the socket of a running daemon */
+	s = sockopen(path, &sun);
+	if (connect(s, (struct sockaddr *) &sun, sizeof(sun)) == 0)
+		errx(1, "%s: already in use", path);
+	close(s);
+	unlink(path);
+
+	/* nobody can connect before listen(), so there is no race */
+	d.sock = sockopen(path, &sun);
+	if (bind(d.sock, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(1, "%s", path);
+	if (chmod(path, S_IRUSR | S_IWUSR) < 0)
+		err(1, "%s", path);
+	if (fcntl(d.sock, F_SETFL, O_NONBLOCK) < 0)
+		err(1, "fcntl");
+	if (listen(d.sock, SOMAXCONN) < 0)
+		err(1, "listen");
+
+	signal(SIGPIPE, SIG_IGN);
+
+	if (funsetlimit(FUNYCODE_LIMIT_LEN, DAEMON_LEN) < 0 ||
+	    funsetlimit(FUNYCODE_LIMIT_CHARS, DAEMON_CHARS) < 0)
+		err(1, "funsetlimit");
+
+	d.enc = cache_new(funencode);
+	d.dec = cache_new(fundecode);
+	cache_setmax(d.enc, CACHEMAX);
+	cache_setmax(d.dec, CACHEMAX);
+
+	for (i = 1; i < nthreads; i++)
+		if ((error = pthread_create(&thread, NULL, serve, &d)) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	serve(&d);
+}
+
+/*
+ * Client mode: have a daemon convert one name per line.
+ */
+
+static void
+client(const char *path, int eflag)
+{
+	struct sockaddr_un sun;
+	unsigned char op;
+	static char buf[MAXFRAME];
+	char *line = NULL;
+	size_t linecap = 0, len;
+	ssize_t linelen;
+	int s;
+
+	s = sockopen(path, &sun);
+	if (connect(s, (struct sockaddr *) &sun, sizeof(sun)) < 0)
+		err(1, "%s", path);
+
+	while ((linelen = getline(&line, &linecap, stdin)) > 0) {
+		while (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen > MAXFRAME)
+			errx(1, "line too long");
+
+		if (sendframe(s, eflag ? 'e' : 'd', line, linelen) < 0 ||
+		    recvframe(s, &op, buf, &len) < 0)
+			err(1, "%s", path);
+		if (op != 0) {
+			errno = op;
+			err(1, eflag ? "funencode" : "fundecode");
+		}
+
+		fwrite(buf, 1, len, stdout);
+		putchar('\n');
+	}
+
+	free(line);
+	close(s);
+}
+
+static void
+printstats(void)
+{
+	static const char *const phases[FUNYCODE_NPHASES] = {
+		[FUNYCODE_PHASE_ENC_CONVERT] = "encode convert",
+		[FUNYCODE_PHASE_COMPRESS] = "encode compress",
+		[FUNYCODE_PHASE_ENC_PREFIX] = "encode prefix",
+		[FUNYCODE_PHASE_ENC_SUFFIX] = "encode suffix",
+		[FUNYCODE_PHASE_DEC_PREFIX] = "decode prefix",
+		[FUNYCODE_PHASE_DEC_SUFFIX] = "decode suffix",
+		[FUNYCODE_PHASE_DECOMPRESS] = "decode decompress",
+		[FUNYCODE_PHASE_DEC_CONVERT] = "decode convert",
+	};
+	struct funycode_stats st;
+	int i;
+
+	if (funycode_stats(&st, 0) < 0) {
+		warn("funycode_stats");
+		return;
+	}
+
+	fprintf(stderr, "encode: %llu calls, %llu chars in, %llu bytes out\n",
+	    st.enc_calls, st.enc_in, st.enc_out);
+	fprintf(stderr, "decode: %llu calls, %llu bytes in, %llu chars out\n",
+	    st.dec_calls, st.dec_in, st.dec_out);
+	fprintf(stderr, "errors: %llu\n", st.errors);
+	fprintf(stderr, "compress: %llu matches, %llu chars saved\n",
+	    st.matches, st.saved);
+	fprintf(stderr, "suffix: %llu deltas, %llu digits\n",
+	    st.deltas, st.digits);
+	fprintf(stderr, "allocs: %llu\n", st.allocs);
+
+	for (i = 0; i < FUNYCODE_NPHASES; i++)
+		if (st.cycles[i] != 0)
+			fprintf(stderr, "cycles: %s: %llu\n", phases[i],
+			    st.cycles[i]);
+}
 
 int
 main(int argc, char *const *argv)
 {
-	int ch, eflag;
+	struct cache *cache = NULL;
+	const char *prog = argv[0], *cpath = NULL, *dpath = NULL;
+	int ch, aflag, Cflag, eflag, sflag, tflag, nthreads;
+	long ncpu, max;
 	size_t linecap = 0, namecap = 0, namelen;
 	ssize_t linelen;
 	char *name = NULL, *line = NULL;
+	const char *enc;
 
 	setlocale(LC_CTYPE, "");
 
-#if defined(__OpenBSD__)
-	if (pledge("stdio", "") < 0)
-		err(1, "pledge");
-#endif
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? ncpu : 1;
 
-	eflag = 0;
-	while ((ch = getopt(argc, argv, "e")) != -1) {
+	aflag = Cflag = eflag = sflag = tflag = 0;
+	while ((ch = getopt(argc, argv, "aCc:d:ej:m:st")) != -1) {
 		switch (ch) {
+		case 'a':
+			aflag = 1;
+			Cflag = eflag = tflag = 0;
+			break;
+
+		case 'C':
+			Cflag = 1;
+			aflag = eflag = tflag = 0;
+			break;
+
+		case 'c':
+			cpath = optarg;
+			break;
+
+		case 'd':
+			dpath = optarg;
+			break;
+
 		case 'e':
 			eflag = 1;
+			aflag = Cflag = tflag = 0;
+			break;
+
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				goto usage;
+			break;
+
+		case 'm':
+			max = atol(optarg);
+			if (max < FUNYCODE_HASHLEN + 3)
+				errx(1, "-m: at least %d characters needed",
+				    FUNYCODE_HASHLEN + 3);
+			maxlen = max;
+			break;
+
+		case 's':
+			sflag = 1;
+			break;
+
+		case 't':
+			tflag = 1;
+			aflag = Cflag = eflag = 0;
 			break;
 
 		case '?':
 		default:
-			fprintf(stderr, "Usage: %s [-e]\n", argv[0]);
-			return 1;
+			goto usage;
 		}
 	}
 
 	argc -= optind;
 	argv += optind;
 
-	while ((linelen = getline(&line, &linecap, stdin)) > 0) {
-		while (line[linelen - 1] == '\n')
-			line[--linelen] = '\0';
+#if defined(__OpenBSD__)
+	if (pledge(cpath != NULL || dpath != NULL ?
+	    "stdio rpath wpath cpath fattr unix" : "stdio", "") < 0)
+		err(1, "pledge");
+#endif
 
-		while (1) {
-			void *new;
+	if ((dpath != NULL || cpath != NULL) && maxlen != 0)
+		goto usage;
 
-			namelen = (eflag ? funencode : fundecode)(name, namecap, line, linelen);
-			if (namelen == FUNYCODE_ERR)
-				err(1, eflag ? "funencode" : "fundecode");
+	if (dpath != NULL) {
+		daemonrun(dpath, nthreads);
+		return 0;
+	} else if (cpath != NULL) {
+		if (aflag || Cflag || tflag)
+			goto usage;
+		client(cpath, eflag);
+		return 0;
+	}
 
-			if (namelen < namecap)
-				break;
+	if (aflag)
+		cache = cache_new(encode);
+	else if (Cflag)
+		cache = cache_new(demangle);
 
-			namecap = namecap == 0 ? 64 : (namecap * 2);
-			if (namecap > UINT16_MAX)
-				errx(1, "result too long (did you mean '-e'?)");
+	while ((linelen = getline(&line, &linecap, stdin)) > 0) {
+		while (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
 
-			new = realloc(name, namecap);
-			if (new == NULL)
-				err(1, "realloc");
-	
-			name = new;
+		if (tflag) {
+			scan(line, linelen);
+			continue;
+		} else if (aflag) {
+			asmline(cache, line, linelen);
+			continue;
+		} else if (Cflag) {
+			if ((enc = cache_conv(cache, line, linelen,
+			    &namelen)) == NULL)
+				err(1, "%s", line);
+			fwrite(enc, 1, namelen, stdout);
+			putchar('\n');
+			continue;
 		}
 
+		namelen = convert(eflag ? encode : fundecode,
+		    &name, &namecap, line, linelen);
+		if (namelen == FUNYCODE_ERR && errno == EOVERFLOW)
+			errx(1, "result too long (did you mean '-e'?)");
+		else if (namelen == FUNYCODE_ERR)
+			err(1, eflag ? "funencode" : "fundecode");
+
 		printf("%s\n", name);
 	}
 
+	if (sflag)
+		printstats();
+
 	return 0;
+
+usage:
+	fprintf(stderr, "Usage: %s [-a | -C | -e | -t] [-m max] [-s]\n"
+	    "       %s -d socket [-j threads]\n"
+	    "       %s -c socket [-e]\n", prog, prog, prog);
+	return 1;
 }
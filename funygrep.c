@@ -0,0 +1,362 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE	/* for memmem() on glibc */
+
+#include "funycode.h"
+
+#include <err.h>
+#include <errno.h>
+#include <locale.h>
+#include <regex.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Names are decoded as by funyfilt -t: identifiers with exactly one
+ * underscore that don't start with an underscore, or with a digit unless
+ * the underscore ends them, if decoding and encoding them again gives the
+ * same identifier back.
+ */
+
+#define ID	1
+#define ENC	2
+
+static const unsigned char ctab[256] = {
+	['0' ... '9'] = ID,
+	['A' ... 'Z'] = ID | ENC,
+	['a' ... 'z'] = ID | ENC,
+	['_'] = ID,
+};
+
+struct buf {
+	char		*p;
+	size_t		 len;
+	size_t		 cap;
+};
+
+static void
+reserve(struct buf *b, size_t len)
+{
+	if (b->len + len <= b->cap)
+		return;
+
+	while (b->len + len > b->cap)
+		b->cap = b->cap == 0 ? 256 : b->cap * 2;
+	if ((b->p = realloc(b->p, b->cap)) == NULL)
+		err(1, "realloc");
+}
+
+static void
+append(struct buf *b, const char *s, size_t len)
+{
+	reserve(b, len);
+	memcpy(b->p + b->len, s, len);
+	b->len += len;
+}
+
+static size_t
+convert(size_t (*fn)(char *, size_t, const char *, size_t), struct buf *b,
+    const char *src, size_t srclen)
+{
+	size_t len;
+
+	b->len = 0;
+	while ((len = fn(b->p, b->cap, src, srclen)) != FUNYCODE_ERR &&
+	    len >= b->cap)
+		reserve(b, len + 1);
+
+	return len;
+}
+
+/*
+ * Decode the names in a line into out. Every name is checked to round-trip
+ * before it's replaced: an identifier such as foo_bar decodes, but to
+ * something that isn't in the line, so a line can only be ruled out once
+ * each of its names has been checked.
+ */
+
+static void
+decodeline(struct buf *out, const char *line, size_t linelen)
+{
+	static struct buf name, enc;
+	const char *p, *end, *s, *u;
+	size_t namelen, enclen;
+
+	out->len = 0;
+	p = line;
+	end = line + linelen;
+	while (p < end) {
+		if (!(ctab[(unsigned char) *p] & ID)) {
+			for (s = p; p < end && !(ctab[(unsigned char) *p] & ID);
+			    p++)
+				;
+			append(out, s, p - s);
+			continue;
+		}
+
+		/* a second underscore makes u == s: not a name */
+		s = p;
+		u = NULL;
+		for (; p < end && (ctab[(unsigned char) *p] & ID); p++)
+			if (*p == '_')
+				u = u == NULL ? p : s;
+
+		if (u == NULL || u == s || (!(ctab[(unsigned char) *s] & ENC) &&
+		    u != p - 1) || !funvalid(s, p - s))
+			goto verbatim;
+
+		namelen = convert(fundecode, &name, s, p - s);
+		if (namelen == FUNYCODE_ERR)
+			goto verbatim;
+		enclen = convert(funencode, &enc, name.p, namelen);
+		if (enclen != (size_t) (p - s) || memcmp(enc.p, s, enclen) != 0)
+			goto verbatim;
+
+		append(out, name.p, namelen);
+		continue;
+
+verbatim:
+		append(out, s, p - s);
+	}
+}
+
+/*
+ * Prefilter. Letters are never encoded, and the first occurrence of any
+ * character is never part of a back reference, so every letter of a
+ * decoded name appears verbatim in its prefix; identifiers that aren't
+ * names are left as they are. The letters a line must contain for the
+ * pattern to possibly match can therefore be checked without decoding
+ * anything. The order of letters can't be relied on, as a repeated part
+ * of the pattern may have been compressed away, and neither can digits,
+ * which are encoded when they come first.
+ */
+
+static uint64_t
+letter(unsigned char ch)
+{
+	if (ch >= 'A' && ch <= 'Z')
+		return UINT64_C(1) << (ch - 'A');
+	else if (ch >= 'a' && ch <= 'z')
+		return UINT64_C(1) << (ch - 'a' + 26);
+
+	return 0;
+}
+
+/*
+ * Letters in a line. Those in the suffix of an encoded name aren't name
+ * characters, but whether an identifier is one is only known once it has
+ * been decoded and checked, so they count as well.
+ */
+
+static uint64_t
+linemask(const char *p, const char *end)
+{
+	uint64_t mask = 0;
+
+	for (; p < end; p++)
+		mask |= letter(*p);
+
+	return mask;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: funygrep [-E | -F] [-cdv] pattern [file ...]\n");
+	exit(2);
+}
+
+struct grep {
+	const char	*pat;
+	size_t		 patlen;
+	regex_t		 re;
+	int		 fixed;
+	uint64_t	 need;		/* letters a matching line must have */
+	int		 cflag;
+	int		 dflag;
+	int		 vflag;
+	unsigned long long count;
+};
+
+static int
+matches(struct grep *g, const char *text, size_t len)
+{
+	static struct buf str;
+
+	if (g->fixed)
+		return memmem(text, len, g->pat, g->patlen) != NULL;
+
+	/* regexec() needs a string */
+	str.len = 0;
+	append(&str, text, len);
+	append(&str, "", 1);
+
+	return regexec(&g->re, str.p, 0, NULL, 0) == 0;
+}
+
+static void
+grep(struct grep *g, FILE *fp, const char *path, int showpath)
+{
+	static struct buf dec;
+	char *line = NULL;
+	const char *text;
+	size_t linecap = 0, textlen, count = 0;
+	ssize_t linelen;
+	int match;
+
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		if (line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+
+		if ((linemask(line, line + linelen) & g->need) != g->need) {
+			match = 0;
+			text = line;
+			textlen = linelen;
+			goto done;
+		}
+
+		if (memchr(line, '_', linelen) == NULL) {
+			/* nothing to decode */
+			text = line;
+			textlen = linelen;
+			match = matches(g, text, textlen);
+		} else {
+			decodeline(&dec, line, linelen);
+			match = matches(g, dec.p, dec.len);
+			text = dec.p;
+			textlen = dec.len;
+		}
+
+done:
+		if (match == g->vflag)
+			continue;
+
+		count++;
+		if (g->cflag)
+			continue;
+		if (g->dflag && text == line && memchr(line, '_', linelen) !=
+		    NULL) {
+			decodeline(&dec, line, linelen);
+			text = dec.p;
+			textlen = dec.len;
+		}
+		if (showpath)
+			printf("%s:", path);
+		fwrite(g->dflag ? text : line, 1, g->dflag ? textlen : linelen,
+		    stdout);
+		putchar('\n');
+	}
+	if (ferror(fp))
+		err(2, "%s", path);
+
+	if (g->cflag) {
+		if (showpath)
+			printf("%s:", path);
+		printf("%zu\n", count);
+	}
+	g->count += count;
+
+	free(line);
+}
+
+int
+main(int argc, char *const *argv)
+{
+	struct grep g = { 0 };
+	const char *p;
+	FILE *fp;
+	int ch, error, eflag = 0, showpath;
+	char msg[256];
+
+	setlocale(LC_CTYPE, "");
+
+	while ((ch = getopt(argc, argv, "cdEFv")) != -1) {
+		switch (ch) {
+		case 'c':
+			g.cflag = 1;
+			break;
+
+		case 'd':
+			g.dflag = 1;
+			break;
+
+		case 'E':
+			eflag = 1;
+			g.fixed = 0;
+			break;
+
+		case 'F':
+			g.fixed = 1;
+			eflag = 0;
+			break;
+
+		case 'v':
+			g.vflag = 1;
+			break;
+
+		case '?':
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1)
+		usage();
+
+	g.pat = argv[0];
+	g.patlen = strlen(g.pat);
+	if (!g.fixed && (error = regcomp(&g.re, g.pat,
+	    (eflag ? REG_EXTENDED : 0) | REG_NOSUB)) != 0) {
+		regerror(error, &g.re, msg, sizeof(msg));
+		errx(2, "%s", msg);
+	}
+
+	/*
+	 * Fixed strings and regular expressions without special characters
+	 * have all their letters in any match. With -v, every line has to
+	 * be looked at.
+	 */
+
+	if (!g.vflag && (g.fixed ||
+	    strpbrk(g.pat, eflag ? ".[]()*+?{}|^$\\" : ".[]*^$\\") == NULL))
+		for (p = g.pat; *p != '\0'; p++)
+			g.need |= letter(*p);
+
+	argc--;
+	argv++;
+	showpath = argc > 1;
+
+	if (argc == 0)
+		grep(&g, stdin, "stdin", 0);
+	for (; argc > 0; argc--, argv++) {
+		if ((fp = fopen(*argv, "r")) == NULL)
+			err(2, "%s", *argv);
+		grep(&g, fp, *argv, showpath);
+		fclose(fp);
+	}
+
+	if (fflush(stdout) == EOF)
+		err(2, "stdout");
+
+	return g.count > 0 ? 0 : 1;
+}
@@ -0,0 +1,366 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#define _GNU_SOURCE	/* for memmem() on glibc */
+
+#include "funycode.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Index file layout, in native byte order so it can be used straight from
+ * mmap(): a header, the entries sorted by decoded name (bytewise, which
+ * for UTF-8 is code point order), and the strings they point to, each
+ * NUL-terminated. Offsets are relative to the start of the file.
+ */
+
+#define MAGIC	"FUNYIDX1"
+
+struct header {
+	char		 magic[8];
+	uint64_t	 n;
+};
+
+struct entry {
+	uint64_t	 dec;		/* decoded name */
+	uint64_t	 enc;		/* encoded name */
+	uint32_t	 declen;
+	uint32_t	 enclen;
+};
+
+struct name {
+	char		*dec;
+	char		*enc;
+	size_t		 declen;
+	size_t		 enclen;
+};
+
+static int
+namecmp(const void *a, const void *b)
+{
+	const struct name *na = a, *nb = b;
+	int r;
+
+	r = memcmp(na->dec, nb->dec,
+	    na->declen < nb->declen ? na->declen : nb->declen);
+	if (r != 0)
+		return r;
+	else if (na->declen != nb->declen)
+		return na->declen < nb->declen ? -1 : 1;
+
+	return strcmp(na->enc, nb->enc);
+}
+
+static char *
+decode(const char *enc, size_t enclen, size_t *len)
+{
+	char *name;
+	size_t cap;
+
+	cap = enclen * 2 + 1;
+	for (;;) {
+		if ((name = malloc(cap)) == NULL)
+			err(1, "malloc");
+		if ((*len = fundecode(name, cap, enc, enclen)) == FUNYCODE_ERR) {
+			free(name);
+			return NULL;
+		} else if (*len < cap)
+			return name;
+
+		free(name);
+		cap = *len + 1;
+	}
+}
+
+static void
+readnames(FILE *fp, const char *path, struct name **names, size_t *n,
+    size_t *cap)
+{
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	struct name *nm;
+
+	while ((linelen = getline(&line, &linecap, fp)) > 0) {
+		while (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		if (linelen == 0)
+			continue;
+
+		if (*n == *cap) {
+			*cap = *cap == 0 ? 4096 : *cap * 2;
+			if ((*names = reallocarray(*names, *cap,
+			    sizeof(**names))) == NULL)
+				err(1, "reallocarray");
+		}
+
+		nm = &(*names)[*n];
+		if ((nm->dec = decode(line, linelen, &nm->declen)) == NULL) {
+			warn("%s: %s", path, line);
+			continue;
+		}
+		if ((nm->enc = strdup(line)) == NULL)
+			err(1, "strdup");
+		nm->enclen = linelen;
+		(*n)++;
+	}
+	if (ferror(fp))
+		err(1, "%s", path);
+
+	free(line);
+}
+
+static void
+build(const char *index, int argc, char *const *argv)
+{
+	struct header hdr;
+	struct entry e;
+	struct name *names = NULL;
+	size_t i, j, n = 0, cap = 0;
+	uint64_t off;
+	FILE *fp;
+
+	if (argc == 0)
+		readnames(stdin, "stdin", &names, &n, &cap);
+	for (; argc > 0; argc--, argv++) {
+		if ((fp = fopen(*argv, "r")) == NULL)
+			err(1, "%s", *argv);
+		readnames(fp, *argv, &names, &n, &cap);
+		fclose(fp);
+	}
+
+	qsort(names, n, sizeof(*names), namecmp);
+
+	/* drop duplicates */
+	for (i = j = 0; i < n; i++) {
+		if (j > 0 && namecmp(&names[j - 1], &names[i]) == 0) {
+			free(names[i].dec);
+			free(names[i].enc);
+			continue;
+		}
+		names[j++] = names[i];
+	}
+	n = j;
+
+	if ((fp = fopen(index, "w")) == NULL)
+		err(1, "%s", index);
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, MAGIC, sizeof(hdr.magic));
+	hdr.n = n;
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		err(1, "%s", index);
+
+	off = sizeof(hdr) + n * sizeof(e);
+	for (i = 0; i < n; i++) {
+		/* entries only have room for 32-bit lengths */
+		if (names[i].declen > UINT32_MAX ||
+		    names[i].enclen > UINT32_MAX)
+			errx(1, "%s: name too long", names[i].enc);
+
+		e.dec = off;
+		e.declen = names[i].declen;
+		off += names[i].declen + 1;
+		e.enc = off;
+		e.enclen = names[i].enclen;
+		off += names[i].enclen + 1;
+		if (fwrite(&e, sizeof(e), 1, fp) != 1)
+			err(1, "%s", index);
+	}
+	for (i = 0; i < n; i++) {
+		if (fwrite(names[i].dec, 1, names[i].declen + 1, fp) !=
+		    names[i].declen + 1 ||
+		    fwrite(names[i].enc, 1, names[i].enclen + 1, fp) !=
+		    names[i].enclen + 1)
+			err(1, "%s", index);
+		free(names[i].dec);
+		free(names[i].enc);
+	}
+
+	if (fclose(fp) == EOF)
+		err(1, "%s", index);
+
+	free(names);
+}
+
+struct index {
+	const char	*path;
+	const char	*base;
+	size_t		 size;
+	const struct entry *entries;
+	size_t		 n;
+};
+
+static void
+index_open(struct index *idx, const char *path)
+{
+	const struct header *hdr;
+	struct stat st;
+	size_t i;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		err(1, "%s", path);
+	if (fstat(fd, &st) < 0)
+		err(1, "%s", path);
+	if ((size_t) st.st_size < sizeof(*hdr))
+		errx(1, "%s: not an index", path);
+
+	idx->base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (idx->base == MAP_FAILED)
+		err(1, "%s: mmap", path);
+	close(fd);
+
+	idx->path = path;
+	idx->size = st.st_size;
+	hdr = (const struct header *) idx->base;
+	if (memcmp(hdr->magic, MAGIC, sizeof(hdr->magic)) != 0)
+		errx(1, "%s: not an index", path);
+	if (hdr->n > (idx->size - sizeof(*hdr)) / sizeof(struct entry))
+		errx(1, "%s: truncated", path);
+
+	idx->entries = (const struct entry *) (idx->base + sizeof(*hdr));
+	idx->n = hdr->n;
+
+	/* strings must lie within the file and be NUL-terminated */
+	for (i = 0; i < idx->n; i++) {
+		const struct entry *e = &idx->entries[i];
+
+		if (e->dec >= idx->size || e->declen >= idx->size - e->dec ||
+		    e->enc >= idx->size || e->enclen >= idx->size - e->enc ||
+		    idx->base[e->dec + e->declen] != '\0' ||
+		    idx->base[e->enc + e->enclen] != '\0')
+			errx(1, "%s: corrupt", path);
+	}
+}
+
+/*
+ * Find all names starting with a prefix, by binary search for the first
+ * one that isn't smaller.
+ */
+
+static size_t
+prefix(const struct index *idx, const char *q, size_t qlen)
+{
+	const struct entry *e;
+	size_t lo, hi, mid, len, found = 0;
+	int r;
+
+	lo = 0;
+	hi = idx->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		e = &idx->entries[mid];
+		len = e->declen < qlen ? e->declen : qlen;
+		r = memcmp(idx->base + e->dec, q, len);
+		if (r < 0 || (r == 0 && e->declen < qlen))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (; lo < idx->n; lo++, found++) {
+		e = &idx->entries[lo];
+		if (e->declen < qlen || memcmp(idx->base + e->dec, q, qlen) != 0)
+			break;
+		printf("%s\n", idx->base + e->enc);
+	}
+
+	return found;
+}
+
+static size_t
+substring(const struct index *idx, const char *q, size_t qlen)
+{
+	const struct entry *e;
+	size_t i, found = 0;
+
+	for (i = 0; i < idx->n; i++) {
+		e = &idx->entries[i];
+		if (memmem(idx->base + e->dec, e->declen, q, qlen) != NULL) {
+			printf("%s\n", idx->base + e->enc);
+			found++;
+		}
+	}
+
+	return found;
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: funyidx -b index [file ...]\n"
+	    "       funyidx [-s] index query ...\n");
+	exit(1);
+}
+
+int
+main(int argc, char *const *argv)
+{
+	struct index idx;
+	const char *bpath = NULL;
+	size_t found = 0;
+	int ch, sflag = 0;
+
+	setlocale(LC_CTYPE, "");
+
+	while ((ch = getopt(argc, argv, "b:s")) != -1) {
+		switch (ch) {
+		case 'b':
+			bpath = optarg;
+			break;
+
+		case 's':
+			sflag = 1;
+			break;
+
+		case '?':
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (bpath != NULL) {
+		if (sflag)
+			usage();
+		build(bpath, argc, argv);
+		return 0;
+	}
+
+	if (argc < 2)
+		usage();
+
+	index_open(&idx, argv[0]);
+	for (argc--, argv++; argc > 0; argc--, argv++)
+		found += (sflag ? substring : prefix)(&idx, *argv,
+		    strlen(*argv));
+
+	return found > 0 ? 0 : 1;
+}
@@ -0,0 +1,412 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Corpus statistics. Encodes a UTF-8 name per line, in parallel, and
+ * reports how long the results are compared to the names (in bytes), by
+ * the highest character class in each name: totals, what compression and
+ * the suffix digits account for, a histogram of ratios and the names that
+ * grow the most. Output is tab-separated, like funybench's.
+ */
+
+#include "funycode.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define nitems(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+#define ASCII		0
+#define LATIN		1	/* up to U+024F */
+#define BMP		2
+#define ASTRAL		3
+#define NCLASSES	4
+
+static const char *const classes[NCLASSES] = {
+	"ascii", "latin", "bmp", "astral",
+};
+
+#define BUCKET		10	/* histogram bucket size, in percent */
+#define NBUCKETS	21	/* the last one is 200% and up */
+
+#define BLOCK		1024	/* names per unit of work */
+
+struct line {
+	const char	*p;
+	size_t		 len;
+};
+
+struct worst {
+	long long	 grow;		/* bytes added by encoding */
+	double		 ratio;
+	const char	*name;
+	size_t		 len;
+};
+
+struct tally {
+	unsigned long long	 names;
+	unsigned long long	 in;		/* name bytes */
+	unsigned long long	 out;		/* encoded bytes */
+	unsigned long long	 digits;	/* suffix digits */
+	unsigned long long	 matches;	/* back references */
+	unsigned long long	 saved;		/* characters saved by them */
+	unsigned long long	 hist[NBUCKETS];
+};
+
+struct stats {
+	struct tally	 t[NCLASSES];
+	unsigned long long failed;
+	struct worst	*worst;		/* most growth first */
+	size_t		 nworst;
+};
+
+struct job {
+	const struct line *lines;
+	size_t		 nlines;
+	size_t		 next;
+	size_t		 maxworst;
+};
+
+struct worker {
+	struct job	*job;
+	struct stats	 st;
+	pthread_t	 thread;
+};
+
+static int
+class(const char *name, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) name;
+	const unsigned char *end = p + len;
+	int c = ASCII;
+
+	for (; p < end; p++) {
+		if (*p < 0x80)
+			continue;
+		else if (*p >= 0xf0)
+			return ASTRAL;
+		else if (*p >= 0xe0)
+			c = BMP;
+		else if (*p >= 0xc0 && c < BMP && p + 1 < end)
+			c = ((*p & 0x1f) << 6 | (p[1] & 0x3f)) <= 0x24f ?
+			    LATIN : BMP;
+	}
+
+	return c;
+}
+
+/*
+ * Keep the n names that grow the most, in order. Growth is counted in
+ * bytes rather than as a ratio, as otherwise one-character names would
+ * take up the whole list.
+ */
+
+static void
+addworst(struct stats *st, size_t n, long long grow, double ratio,
+    const char *name, size_t len)
+{
+	size_t i;
+
+	if (n == 0 || (st->nworst == n && grow <= st->worst[n - 1].grow))
+		return;
+
+	if (st->nworst < n)
+		st->nworst++;
+	for (i = st->nworst - 1; i > 0 && st->worst[i - 1].grow < grow; i--)
+		st->worst[i] = st->worst[i - 1];
+	st->worst[i].grow = grow;
+	st->worst[i].ratio = ratio;
+	st->worst[i].name = name;
+	st->worst[i].len = len;
+}
+
+static void
+count(struct stats *st, size_t maxworst, const char *name, size_t len,
+    char **enc, size_t *cap)
+{
+	struct funinfo fi;
+	struct tally *t;
+	size_t enclen, b;
+	double ratio;
+
+	while ((enclen = funencode(*enc, *cap, name, len)) != FUNYCODE_ERR &&
+	    enclen >= *cap) {
+		*cap = enclen + 1;
+		if ((*enc = realloc(*enc, *cap)) == NULL)
+			err(1, "realloc");
+	}
+	if (enclen == FUNYCODE_ERR || funinfo(&fi, *enc, enclen) < 0) {
+		st->failed++;
+		return;
+	}
+
+	t = &st->t[class(name, len)];
+	t->names++;
+	t->in += len;
+	t->out += enclen;
+	t->digits += fi.digits;
+	t->matches += fi.matches;
+	t->saved += fi.saved;
+
+	ratio = len == 0 ? 1 : (double) enclen / len;
+	b = ratio * 100 / BUCKET;
+	t->hist[b < NBUCKETS ? b : NBUCKETS - 1]++;
+
+	addworst(st, maxworst, (long long) enclen - len, ratio, name, len);
+}
+
+static void *
+work(void *arg)
+{
+	struct worker *w = arg;
+	struct job *j = w->job;
+	char *enc = NULL;
+	size_t i, end, cap = 0;
+
+	if ((w->st.worst = calloc(j->maxworst + 1, sizeof(*w->st.worst))) ==
+	    NULL)
+		err(1, "calloc");
+
+	while ((i = __atomic_fetch_add(&j->next, BLOCK, __ATOMIC_RELAXED)) <
+	    j->nlines) {
+		end = i + BLOCK < j->nlines ? i + BLOCK : j->nlines;
+		for (; i < end; i++)
+			count(&w->st, j->maxworst, j->lines[i].p,
+			    j->lines[i].len, &enc, &cap);
+	}
+	free(enc);
+
+	return NULL;
+}
+
+static void
+merge(struct stats *st, const struct stats *from, size_t maxworst)
+{
+	size_t c, i;
+
+	for (c = 0; c < NCLASSES; c++) {
+		st->t[c].names += from->t[c].names;
+		st->t[c].in += from->t[c].in;
+		st->t[c].out += from->t[c].out;
+		st->t[c].digits += from->t[c].digits;
+		st->t[c].matches += from->t[c].matches;
+		st->t[c].saved += from->t[c].saved;
+		for (i = 0; i < NBUCKETS; i++)
+			st->t[c].hist[i] += from->t[c].hist[i];
+	}
+	st->failed += from->failed;
+
+	for (i = 0; i < from->nworst; i++)
+		addworst(st, maxworst, from->worst[i].grow,
+		    from->worst[i].ratio, from->worst[i].name,
+		    from->worst[i].len);
+}
+
+static double
+pct(unsigned long long a, unsigned long long b)
+{
+	return b == 0 ? 0 : 100.0 * a / b;
+}
+
+static void
+report(const struct stats *st)
+{
+	struct tally all = { 0 };
+	const struct tally *t;
+	size_t c, i, first, last;
+
+	printf("class\tnames\tbytes\tencoded\tratio\tdigits\tmatches\tsaved\n");
+	for (c = 0; c <= NCLASSES; c++) {
+		if (c < NCLASSES) {
+			t = &st->t[c];
+			all.names += t->names;
+			all.in += t->in;
+			all.out += t->out;
+			all.digits += t->digits;
+			all.matches += t->matches;
+			all.saved += t->saved;
+		} else
+			t = &all;
+
+		printf("%s\t%llu\t%llu\t%llu\t%.1f%%\t%.1f%%\t%llu\t%llu\n",
+		    c < NCLASSES ? classes[c] : "all", t->names, t->in, t->out,
+		    pct(t->out, t->in), pct(t->digits, t->out), t->matches,
+		    t->saved);
+	}
+	printf("failed\t%llu\n", st->failed);
+
+	/* histogram rows from the first to the last one used */
+	first = NBUCKETS;
+	last = 0;
+	for (c = 0; c < NCLASSES; c++)
+		for (i = 0; i < NBUCKETS; i++)
+			if (st->t[c].hist[i] != 0) {
+				first = i < first ? i : first;
+				last = i > last ? i : last;
+			}
+
+	printf("\nratio");
+	for (c = 0; c < NCLASSES; c++)
+		printf("\t%s", classes[c]);
+	putchar('\n');
+	for (i = first; i <= last && first < NBUCKETS; i++) {
+		printf("%zu%%%s", i * BUCKET, i == NBUCKETS - 1 ? "+" : "");
+		for (c = 0; c < NCLASSES; c++)
+			printf("\t%llu", st->t[c].hist[i]);
+		putchar('\n');
+	}
+
+	printf("\ngrowth\tratio\tworst\n");
+	for (i = 0; i < st->nworst; i++)
+		printf("%+lld\t%.1f%%\t%.*s\n", st->worst[i].grow,
+		    st->worst[i].ratio * 100, (int) st->worst[i].len,
+		    st->worst[i].name);
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: funystat [-j threads] [-n worst] [file]\n");
+	exit(1);
+}
+
+int
+main(int argc, char *const *argv)
+{
+	struct stat sb;
+	struct stats st = { 0 };
+	struct job j = { 0 };
+	struct worker *w;
+	struct line *lines = NULL;
+	size_t len, incap = 0, nlines = 0, linecap = 0;
+	const char *p, *end, *nl;
+	char *src, *in = NULL;
+	ssize_t n;
+	long ncpu;
+	int ch, fd, i, nthreads, error;
+
+	if (setlocale(LC_CTYPE, "") == NULL || MB_CUR_MAX == 1)
+		if (setlocale(LC_CTYPE, "C.UTF-8") == NULL)
+			errx(1, "need a UTF-8 locale");
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpu > 0 ? ncpu : 1;
+	j.maxworst = 10;
+
+	while ((ch = getopt(argc, argv, "j:n:")) != -1) {
+		switch (ch) {
+		case 'j':
+			nthreads = atoi(optarg);
+			if (nthreads < 1)
+				usage();
+			break;
+
+		case 'n':
+			j.maxworst = strtoul(optarg, NULL, 10);
+			break;
+
+		case '?':
+		default:
+			usage();
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc > 1)
+		usage();
+
+	if (argc == 1) {
+		if ((fd = open(argv[0], O_RDONLY)) < 0)
+			err(1, "%s", argv[0]);
+		if (fstat(fd, &sb) < 0)
+			err(1, "%s", argv[0]);
+		len = sb.st_size;
+		src = len == 0 ? NULL :
+		    mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (src == MAP_FAILED)
+			err(1, "%s: mmap", argv[0]);
+		close(fd);
+	} else {
+		for (len = 0;; len += n) {
+			if (len == incap) {
+				incap = incap == 0 ? 65536 : incap * 2;
+				if ((in = realloc(in, incap)) == NULL)
+					err(1, "realloc");
+			}
+			if ((n = read(STDIN_FILENO, in + len, incap - len)) < 0)
+				err(1, "stdin");
+			else if (n == 0)
+				break;
+		}
+		src = in;
+	}
+
+	for (p = src, end = src + len; p < end; p = nl + 1) {
+		if ((nl = memchr(p, '\n', end - p)) == NULL)
+			nl = end;
+		if (nlines == linecap) {
+			linecap = linecap == 0 ? 4096 : linecap * 2;
+			if ((lines = realloc(lines, linecap * sizeof(*lines))) ==
+			    NULL)
+				err(1, "realloc");
+		}
+		lines[nlines].p = p;
+		lines[nlines++].len = nl - p;
+	}
+	j.lines = lines;
+	j.nlines = nlines;
+
+	if ((w = calloc(nthreads, sizeof(*w))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nthreads; i++) {
+		w[i].job = &j;
+		if (i > 0 && (error = pthread_create(&w[i].thread, NULL, work,
+		    &w[i])) != 0) {
+			errno = error;
+			err(1, "pthread_create");
+		}
+	}
+	work(&w[0]);
+
+	if ((st.worst = calloc(j.maxworst + 1, sizeof(*st.worst))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < nthreads; i++) {
+		if (i > 0)
+			pthread_join(w[i].thread, NULL);
+		merge(&st, &w[i].st, j.maxworst);
+		free(w[i].st.worst);
+	}
+	free(w);
+
+	report(&st);
+
+	if (fflush(stdout) == EOF)
+		err(1, "stdout");
+
+	return 0;
+}
@@ -0,0 +1,385 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Takes encoded names from stdin, one per line, and runs each through the
+ * rest of the interface, failing if any of it disagrees with fundecode().
+ */
+
+#include "funycode.h"
+
+#include <err.h>
+#include <errno.h>
+#include <locale.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#define nitems(arr)	(sizeof(arr) / sizeof((arr)[0]))
+
+struct name {
+	char		*enc;
+	size_t		 enclen;
+	char		*dec;
+	size_t		 declen;
+	wchar_t		*wdec;
+	size_t		 wdeclen;
+};
+
+static size_t lineno;
+
+/*
+ * funvalid() turns down names that aren't encodings, which fundecode()
+ * leaves as they are, but every name it accepts must decode; cutting a
+ * name short makes plenty of both. The undecodable names are encodings
+ * that are broken, or give characters past U+10FFFF.
+ */
+
+#define MAXCUT	256
+
+static const char *const invalid[] = {
+	"_", "_foo", "5", "0foo", "0foo_l1D", "foo-bar", "\xc3\xa9",
+};
+
+static const char *const undecodable[] = {
+	"foo_3", "foo_$", "foo__", "btzfiyac_", "mycrateFoou32asBaru64foo_",
+};
+
+static void
+check_valid(const struct name *n)
+{
+	size_t cut;
+
+	for (cut = 0; cut < n->enclen && cut < MAXCUT; cut++)
+		if (funvalid(n->enc, cut) &&
+		    fundecode(NULL, 0, n->enc, cut) == FUNYCODE_ERR)
+			errx(1, "line %zu: funvalid %zu: %s", lineno, cut,
+			    n->enc);
+}
+
+/*
+ * The key must be the decoded name for every length, stopping anywhere in
+ * a back reference included. Names longer than MAXKEY characters are only
+ * tried at their full length, as each call decodes the whole suffix.
+ */
+
+#define MAXKEY	1024
+
+static void
+check_key(const struct name *n)
+{
+	uint32_t *key;
+	size_t keylen, i;
+
+	if ((key = calloc(n->wdeclen + 1, sizeof(*key))) == NULL)
+		err(1, "calloc");
+
+	for (keylen = 0; keylen <= n->wdeclen + 1; keylen++) {
+		if (n->wdeclen > MAXKEY && keylen < n->wdeclen)
+			keylen = n->wdeclen;
+		if (funkey(key, keylen, n->enc, n->enclen) != n->wdeclen)
+			errx(1, "line %zu: funkey %zu: %s", lineno, keylen,
+			    n->enc);
+		for (i = 0; i < keylen; i++)
+			if (key[i] != (i < n->wdeclen ? (uint32_t) n->wdec[i] :
+			    0))
+				errx(1, "line %zu: funkey %zu: %s", lineno,
+				    keylen, n->enc);
+	}
+
+	free(key);
+}
+
+/*
+ * Decode through caller-supplied workspace, which must fail with ENOBUFS
+ * if it is any smaller than FUNYCODE_WSLEN().
+ */
+
+static void
+check_ws(const struct name *n)
+{
+	char *name;
+	void *ws;
+	size_t wslen = FUNYCODE_WSLEN(n->enclen), len;
+
+	if ((ws = malloc(wslen)) == NULL || (name = malloc(n->declen + 1)) ==
+	    NULL)
+		err(1, "malloc");
+
+	len = fundecode_ws(name, n->declen + 1, n->enc, n->enclen, ws, wslen);
+	if (len != n->declen || memcmp(name, n->dec, len + 1) != 0)
+		errx(1, "line %zu: fundecode_ws: %s", lineno, n->enc);
+
+	errno = 0;
+	len = fundecode_ws(name, n->declen + 1, n->enc, n->enclen, ws,
+	    wslen - 1);
+	if (len != FUNYCODE_ERR || errno != ENOBUFS)
+		errx(1, "line %zu: fundecode_ws: short workspace: %s", lineno,
+		    n->enc);
+
+	free(ws);
+	free(name);
+}
+
+/*
+ * Decode with the streaming decoder, fed a byte and then a few at a time.
+ */
+
+static void
+check_stream(const struct name *n)
+{
+	struct fundecoder *d;
+	char *name;
+	size_t step, i, len;
+
+	if ((d = fundecoder_new()) == NULL || (name = malloc(n->declen + 1)) ==
+	    NULL)
+		err(1, "malloc");
+
+	for (step = 1; step <= 7; step += 6) {
+		fundecoder_reset(d);
+		for (i = 0; i < n->enclen; i += step)
+			if (fundecoder_feed(d, n->enc + i, n->enclen - i < step ?
+			    n->enclen - i : step) < 0)
+				err(1, "line %zu: fundecoder_feed: %s", lineno,
+				    n->enc);
+		len = fundecoder_finish(d, name, n->declen + 1);
+		if (len != n->declen || memcmp(name, n->dec, len + 1) != 0)
+			errx(1, "line %zu: fundecoder_finish: %s", lineno,
+			    n->enc);
+	}
+
+	fundecoder_free(d);
+	free(name);
+}
+
+/*
+ * Build the name from a fragment ending at a character boundary, one that
+ * is taken back again, and the rest in two pieces split anywhere.
+ */
+
+static void
+check_builder(const struct name *n)
+{
+	struct funbuilder *b;
+	char *enc;
+	size_t half = n->declen / 2, rest, mark, len;
+
+	if ((b = funbuilder_new()) == NULL ||
+	    (enc = malloc(n->enclen + 1)) == NULL)
+		err(1, "malloc");
+
+	while (half > 0 && (n->dec[half] & 0xc0) == 0x80)
+		half--;
+	rest = half + (n->declen - half) / 2;
+
+	if (funbuilder_append(b, n->dec, half) < 0 ||
+	    (mark = funbuilder_mark(b)) == FUNYCODE_ERR ||
+	    funbuilder_append(b, "\xc3\xa9x", 3) < 0 ||
+	    funbuilder_rewind(b, mark) < 0 ||
+	    funbuilder_append(b, n->dec + half, rest - half) < 0 ||
+	    funbuilder_append(b, n->dec + rest, n->declen - rest) < 0)
+		err(1, "line %zu: funbuilder: %s", lineno, n->enc);
+
+	len = funbuilder_encode(b, enc, n->enclen + 1);
+	if (len != n->enclen || memcmp(enc, n->enc, len + 1) != 0)
+		errx(1, "line %zu: funbuilder_encode: %s", lineno, n->enc);
+
+	funbuilder_free(b);
+	free(enc);
+}
+
+/*
+ * Capped names must fit and end in the hash of the name, which funhash()
+ * gets from the full encoding; uncapped ones are the same as ever.
+ */
+
+static void
+mapped(const char *enc, size_t enclen, const char *name, size_t namelen,
+    void *arg)
+{
+	(*(size_t *) arg)++;
+}
+
+static char
+digit(unsigned int v)
+{
+	return v < 10 ? '0' + v : v < 36 ? 'A' + v - 10 : 'a' + v - 36;
+}
+
+static void
+check_hash(const struct name *n)
+{
+	/* positive: the maximum; otherwise relative to the encoded length */
+	static const int maxes[] = {
+		FUNYCODE_HASHLEN + 3, 32, 63, -1, 0, 1,
+	};
+	char *enc, tail[FUNYCODE_HASHLEN];
+	uint64_t h, hb;
+	size_t max, len, nmapped, i;
+
+	if (funhash(&h, n->enc, n->enclen) < 0)
+		err(1, "line %zu: funhash: %s", lineno, n->enc);
+	if (funhash_batch(&hb, (const char *const *) &n->enc, &n->enclen,
+	    1) != 1 || hb != h)
+		errx(1, "line %zu: funhash_batch: %s", lineno, n->enc);
+
+	for (i = FUNYCODE_HASHLEN; i-- > 0; h /= 62)
+		tail[i] = digit(h % 62);
+
+	if ((enc = malloc(n->enclen + 1)) == NULL)
+		err(1, "malloc");
+	for (i = 0; i < nitems(maxes); i++) {
+		max = maxes[i] > 0 ? (size_t) maxes[i] : n->enclen + maxes[i];
+		if (max < FUNYCODE_HASHLEN + 3 || max > n->enclen + 1)
+			continue;
+		nmapped = 0;
+		len = funencode_max(enc, n->enclen + 1, n->dec, n->declen, max,
+		    mapped, &nmapped);
+		if (len == FUNYCODE_ERR)
+			err(1, "line %zu: funencode_max %zu: %s", lineno, max,
+			    n->enc);
+		if (n->enclen <= max ? len != n->enclen || nmapped != 0 ||
+		    memcmp(enc, n->enc, len) != 0 :
+		    len != max || nmapped != 1 ||
+		    memcmp(enc + len - FUNYCODE_HASHLEN, tail,
+		    FUNYCODE_HASHLEN) != 0)
+			errx(1, "line %zu: funencode_max %zu: %s", lineno, max,
+			    n->enc);
+	}
+
+	free(enc);
+}
+
+static void
+check(struct name *n)
+{
+	struct funinfo fi;
+	size_t len;
+
+	if (!funvalid(n->enc, n->enclen))
+		errx(1, "line %zu: funvalid: %s", lineno, n->enc);
+
+	len = fundecode(NULL, 0, n->enc, n->enclen);
+	if (len == FUNYCODE_ERR)
+		err(1, "line %zu: fundecode: %s", lineno, n->enc);
+	if ((n->dec = malloc(len + 1)) == NULL)
+		err(1, "malloc");
+	n->declen = fundecode(n->dec, len + 1, n->enc, n->enclen);
+	check_valid(n);
+
+	len = wfundecode(NULL, 0, n->enc, n->enclen);
+	if ((n->wdec = malloc((len + 1) * sizeof(wchar_t))) == NULL)
+		err(1, "malloc");
+	n->wdeclen = wfundecode(n->wdec, len + 1, n->enc, n->enclen);
+	if (n->wdeclen != len)
+		errx(1, "line %zu: wfundecode: %s", lineno, n->enc);
+
+	if (funinfo(&fi, n->enc, n->enclen) < 0 || fi.len != n->wdeclen)
+		errx(1, "line %zu: funinfo: %s", lineno, n->enc);
+
+	check_key(n);
+	check_ws(n);
+	check_stream(n);
+	check_builder(n);
+	check_hash(n);
+}
+
+/*
+ * funycmp() must order names by the code points of their decoded forms.
+ */
+
+static int
+wcmp(const struct name *a, const struct name *b)
+{
+	size_t i;
+
+	for (i = 0; i < a->wdeclen && i < b->wdeclen; i++)
+		if (a->wdec[i] != b->wdec[i])
+			return (uint32_t) a->wdec[i] < (uint32_t) b->wdec[i] ?
+			    -1 : 1;
+
+	return a->wdeclen < b->wdeclen ? -1 : a->wdeclen > b->wdeclen;
+}
+
+static int
+sign(int r)
+{
+	return r < 0 ? -1 : r > 0;
+}
+
+static void
+check_cmp(const struct name *a, const struct name *b)
+{
+	if (sign(funycmp(a->enc, a->enclen, b->enc, b->enclen)) != wcmp(a, b) ||
+	    funycmp(a->enc, a->enclen, a->enc, a->enclen) != 0)
+		errx(1, "line %zu: funycmp: %s, %s", lineno, a->enc, b->enc);
+}
+
+int
+main(void)
+{
+	struct name *names = NULL;
+	const char **encs;
+	size_t i, n = 0, cap = 0, linecap = 0;
+	char *line = NULL;
+	ssize_t len;
+
+	if (setlocale(LC_CTYPE, "C.UTF-8") == NULL)
+		errx(1, "need a UTF-8 locale");
+
+	while ((len = getline(&line, &linecap, stdin)) != -1) {
+		lineno++;
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+
+		if (n == cap) {
+			cap = cap == 0 ? 1024 : cap * 2;
+			if ((names = realloc(names, cap * sizeof(*names))) ==
+			    NULL)
+				err(1, "realloc");
+		}
+		if ((names[n].enc = strdup(line)) == NULL)
+			err(1, "strdup");
+		names[n].enclen = len;
+		check(&names[n]);
+		if (n > 0)
+			check_cmp(&names[n - 1], &names[n]);
+		n++;
+	}
+	if (ferror(stdin))
+		err(1, "stdin");
+
+	if ((encs = calloc(n, sizeof(*encs))) == NULL)
+		err(1, "calloc");
+	for (i = 0; i < n; i++)
+		encs[i] = names[i].enc;
+	if (funvalid_batch(encs, NULL, n, NULL) != n)
+		errx(1, "funvalid_batch");
+
+	for (i = 0; i < nitems(invalid); i++)
+		if (funvalid(invalid[i], strlen(invalid[i])))
+			errx(1, "funvalid: %s", invalid[i]);
+	for (i = 0; i < nitems(undecodable); i++)
+		if (funvalid(undecodable[i], strlen(undecodable[i])) ||
+		    fundecode(NULL, 0, undecodable[i], strlen(undecodable[i])) !=
+		    FUNYCODE_ERR || errno != EILSEQ)
+			errx(1, "fundecode: %s", undecodable[i]);
+
+	return 0;
+}
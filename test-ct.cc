@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Checks names encoded at compile time against the runtime encoder.
+ */
+
+#include "funycode.hpp"
+
+#include <iostream>
+
+using namespace funycode::literals;
+
+static int fails;
+
+static void
+check(std::u32string_view name, std::string_view ct)
+{
+	funycode::small_string rt = funycode::encode(name);
+
+	if (rt.view() != ct) {
+		std::cerr << "mismatch: " << ct << " != " << rt.c_str() << "\n";
+		fails++;
+	}
+}
+
+#define CHECK(s)	check(U##s, funycode::encode<u8##s>())
+
+int
+main()
+{
+	static_assert(funycode::encode<"foo">().view() == "foo");
+	static_assert(u8"føø"_funy.view() == funycode::encode<U"føø">());
+
+	CHECK("");
+	CHECK("foo");
+	CHECK("0foo");
+	CHECK("0f0");
+	CHECK("føø");
+	CHECK("_");
+	CHECK("__init__");
+	CHECK("std::vector<int, std::allocator<int> >::push_back(int const&)");
+	CHECK("std::__1::basic_string<char, std::__1::char_traits<char>, "
+	    "std::__1::allocator<char> >::basic_string(char const*)");
+	CHECK("自転車::自転車(自転車 const&)");
+	CHECK("𝓯𝓸𝓸 bar 𝓯𝓸𝓸 bar 𝓯𝓸𝓸 bar");
+	CHECK("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa");
+	CHECK("12345 67890 12345 67890");
+	CHECK("Grüße, Jürgen ❤");
+
+	return fails != 0;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Looks up the symbols of the library built from test-elf.c by their
+ * Unicode names from several threads at once, while the main thread keeps
+ * closing and reopening the library under them.
+ */
+#include <dlfcn.h>
+#include <wchar.h>
+
+#include "funycode.h"
+
+#include <err.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define NTHREADS	4
+#define NLOOKUPS	200000
+#define NREOPEN		1000
+
+static const char *path;
+static void *lib;
+static int (*func)(int);
+static int *var;
+
+static void *
+worker(void *arg)
+{
+	const char *names[] = { "b\xc3\xbc" "cher", "h\xc3\xb6rb\xc3\xbc" "cher" };
+	void *addrs[2];
+	int i;
+
+	for (i = 0; i < NLOOKUPS; i++) {
+		if (fundlsym(lib, "h\xc3\xb6rb\xc3\xbc" "cher") != (void *) func ||
+		    wfundlsym(lib, L"bücher") != var)
+			errx(1, "fundlsym: wrong address");
+		if (i % 1000 == 0 &&
+		    (fundlprefetch(lib, names, 2, addrs) != 2 ||
+		    addrs[0] != var || addrs[1] != (void *) func))
+			errx(1, "fundlprefetch: wrong address");
+	}
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	pthread_t threads[NTHREADS];
+	void *again;
+	int i, error;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: test-dlsym library\n");
+		return 1;
+	}
+	path = argv[1];
+
+	if ((lib = dlopen(path, RTLD_NOW)) == NULL)
+		errx(1, "%s", dlerror());
+	func = (int (*)(int)) fundlsym(lib, "h\xc3\xb6rb\xc3\xbc" "cher");
+	var = fundlsym(lib, "b\xc3\xbc" "cher");
+	if (func == NULL || var == NULL || fundlsym(lib, "nonexistent") !=
+	    NULL)
+		errx(1, "fundlsym: %s", dlerror());
+	if (func(0) != *var)
+		errx(1, "fundlsym: wrong symbol");
+
+	for (i = 0; i < NTHREADS; i++)
+		if ((error = pthread_create(&threads[i], NULL, worker,
+		    NULL)) != 0)
+			errx(1, "pthread_create: %d", error);
+
+	/* the library stays loaded, but each close drops the cache */
+	for (i = 0; i < NREOPEN; i++) {
+		if ((again = dlopen(path, RTLD_NOW)) != lib)
+			errx(1, "%s: reopened elsewhere", path);
+		if (fundlclose(again) != 0)
+			errx(1, "fundlclose: %s", dlerror());
+	}
+
+	for (i = 0; i < NTHREADS; i++)
+		pthread_join(threads[i], NULL);
+
+	if (fundlclose(lib) != 0)
+		errx(1, "fundlclose: %s", dlerror());
+
+	return 0;
+}
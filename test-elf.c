@@ -0,0 +1,24 @@
+/*
+ * Unicode identifiers, all of them in test.txt, for testing funyelf.
+ */
+
+int bücher = 3;
+static int 自転車[2];
+
+int
+hörbücher(int x)
+{
+	return x + bücher + 自転車[1];
+}
+
+static int
+велосипед(void)
+{
+	return hörbücher(0);
+}
+
+int
+main(void)
+{
+	return велосипед() != 3;
+}
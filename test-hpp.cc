@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2022, 2023 Willemijn Coene
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Encodes UTF-8 names from stdin, one per line, through every entry point
+ * of funycode.hpp, failing if they don't all agree or don't decode back.
+ */
+
+#include "funycode.hpp"
+
+#include <iostream>
+#include <string>
+
+int
+main()
+{
+	std::pmr::monotonic_buffer_resource mr;
+	std::string line;
+
+	while (std::getline(std::cin, line)) {
+		funycode::small_string enc = funycode::encode(line, &mr);
+		std::u32string u32 = funycode::decode_u32(enc);
+		std::wstring w = funycode::decode_wide(enc);
+		std::string s = "x";
+		std::pmr::string ps("y", &mr);
+
+		funycode::encode_append(s, line);
+		funycode::encode_append(ps, u32, &mr);
+		if (funycode::encode(u32).view() != enc.view() ||
+		    funycode::encode(w).view() != enc.view() ||
+		    s != "x" + std::string(enc) || ps.substr(1) != enc.view() ||
+		    funycode::decode(enc).view() != line) {
+			std::cerr << "mismatch: " << line << "\n";
+			return 1;
+		}
+
+		s.clear();
+		funycode::decode_append(s, enc.view());
+		if (s != line) {
+			std::cerr << "mismatch: " << line << "\n";
+			return 1;
+		}
+
+		std::cout << enc.c_str() << "\n";
+	}
+
+	return 0;
+}